@@ -39,7 +39,7 @@ void find_convex_hull(int num_vertices, v2 *vertices, int *num_hull_lines, v2 **
     for(int i = 0; i < num_vertices; i++)
     {
         v2 *point = &(vertices[i]);
-        if(abs(point->y - lowest_point->y) < EPSILON)
+        if(GameMath::abs(point->y - lowest_point->y) < EPSILON)
         {
             lowest_point = (point->x < lowest_point->x) ? point : lowest_point;
         }
@@ -72,7 +72,7 @@ void find_convex_hull(int num_vertices, v2 *vertices, int *num_hull_lines, v2 **
             v2 *next_top_stack = hull[*num_hull_lines - 2];
             float cross_p = cross(*next_top_stack, *top_stack, *next_considered_point);
 
-            if(abs(cross_p) < EPSILON)
+            if(GameMath::abs(cross_p) < EPSILON)
             {
                 // The 3 points are collinear, take the furthest one
                 if(length_squared(*next_top_stack - *next_considered_point) < length_squared(*next_top_stack - *top_stack))
@@ -0,0 +1,266 @@
+
+#include "benchmarks.h"
+#include "level_generator.h"
+#include "levels.h"
+#include "game.h"
+#include "graphics.h"
+#include "jobs.h"
+#include "platform.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+
+
+using namespace GameMath;
+
+
+
+#define BENCH_LEVELS_DIR "output/bench/"
+
+static const int BENCH_LEVEL_SIZES[] = {1000, 10000, 100000, 1000000, 10000000};
+static const int BENCH_AVATARS = 256;
+static const int BENCH_TICKS = 120;
+static const int BENCH_FRAMES = 60;
+// Ticks stepped before measuring, the first ones add the avatars and fill the scratch buffers
+static const int SIMULATION_WARMUP_TICKS = 60;
+
+std::atomic<int64_t> Benchmarks::num_allocations(0);
+std::atomic<int64_t> Benchmarks::allocated_bytes(0);
+bool Benchmarks::counting_allocations = false;
+
+// Same inputs every run, the benchmark should only change when the code does
+static uint32_t next_bench_random(uint32_t *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 16;
+}
+
+static GameInputList make_bench_inputs(uint32_t *random_state)
+{
+    GameInputList inputs;
+    for(int i = 0; i < BENCH_AVATARS; i++)
+    {
+        GameInput input;
+        input.uid = i;
+        input.current_horizontal_movement = (float)((int)(next_bench_random(random_state) % 3) - 1);
+        input.current_actions[(int)GameInput::Action::JUMP] = (next_bench_random(random_state) % 8) == 0;
+        inputs.push_back(input);
+    }
+    return inputs;
+}
+
+static int file_size(const char *path)
+{
+    Platform::File *file = Platform::FileSystem::open(path, Platform::FileSystem::READ);
+    if(file == nullptr) return 0;
+    int size = Platform::FileSystem::size(file);
+    Platform::FileSystem::close(file);
+    return size;
+}
+
+static void bench_level(LevelGenerator::Pattern pattern, int num_tiles)
+{
+    LevelGenerator::Settings settings;
+    settings.pattern = pattern;
+    settings.num_tiles = num_tiles;
+
+    char path[128];
+    snprintf(path, sizeof(path), BENCH_LEVELS_DIR "%s_%i", LevelGenerator::pattern_name(pattern), num_tiles);
+
+    double start = Platform::time_since_start();
+    LevelGenerator::write(path, settings);
+    double generate_time = Platform::time_since_start() - start;
+
+    // All of it, streaming only reads what's around the avatars
+    Level *level = new Level();
+    level->clear();
+    level->stream_chunks = false;
+    start = Platform::time_since_start();
+    level->load_with_file(path, true);
+    double load_time = Platform::time_since_start() - start;
+    int grid_bytes = (int)level->grid.chunks.size() * (int)sizeof(Level::Grid::Chunk);
+
+    // Everyone joins at the start point, then gets spread over the top quarter of the level
+    uint32_t random_state = 12345;
+    level->change_mode(Level::PLAYING);
+    level->step(make_bench_inputs(&random_state), Engine::TARGET_STEP_TIME);
+    int side = (int)ceil(sqrt((double)num_tiles));
+    for(int i = 0; i < level->avatars.count(); i++)
+    {
+        int x = (int)(next_bench_random(&random_state) % side);
+        int y = side - 1 - (int)(next_bench_random(&random_state) % (side / 4 + 1));
+        level->avatars.positions[i] = level->grid.cell_to_world(Level::v2i(x, y));
+        level->avatars.previous_positions[i] = level->avatars.positions[i];
+    }
+
+    double step_time = 0.0;
+    for(int tick = 0; tick < BENCH_TICKS; tick++)
+    {
+        GameInputList inputs = make_bench_inputs(&random_state);
+        level->change_mode(Level::PLAYING); // Keep going after someone wins or falls out
+
+        start = Platform::time_since_start();
+        level->step(inputs, Engine::TARGET_STEP_TIME);
+        step_time += Platform::time_since_start() - start;
+    }
+    double step_ns_per_avatar = step_time / ((double)BENCH_TICKS * BENCH_AVATARS) * 1000000000.0;
+
+    double bake_time = 0.0;
+    double draw_time = 0.0;
+#if !HEADLESS
+    if(!Engine::instance->headless)
+    {
+        start = Platform::time_since_start();
+        for(Level::Grid::Chunk *chunk : level->grid.chunks)
+        {
+            if(chunk->render_dirty) level->grid.bake_chunk(chunk);
+        }
+        bake_time = Platform::time_since_start() - start;
+
+        level->change_mode(Level::PLAYING);
+        start = Platform::time_since_start();
+        for(int frame = 0; frame < BENCH_FRAMES; frame++)
+        {
+            level->draw(0, 1.0f);
+        }
+        draw_time = (Platform::time_since_start() - start) / BENCH_FRAMES;
+    }
+#endif
+
+    printf("%-10s %9i %8i %9i %10.2f %9.2f %10i %9.2f %10.1f %9.2f %9.1f\n", LevelGenerator::pattern_name(pattern), num_tiles,
+            (int)level->grid.chunks.size(), file_size(path) / 1024, generate_time * 1000.0, load_time * 1000.0, grid_bytes / 1024,
+            step_time / BENCH_TICKS * 1000.0, step_ns_per_avatar, bake_time * 1000.0, draw_time * 1000000.0);
+    fflush(stdout);
+
+    Levels::destroy_level(level);
+}
+
+
+
+void Benchmarks::level_scaling()
+{
+    printf("%i avatars, %i ticks, %i frames, %i job workers\n", BENCH_AVATARS, BENCH_TICKS, BENCH_FRAMES, Jobs::num_workers());
+    printf("%-10s %9s %8s %9s %10s %9s %10s %9s %10s %9s %9s\n", "pattern", "tiles", "chunks", "file KB", "gen ms",
+            "load ms", "grid KB", "tick ms", "ns/avatar", "bake ms", "draw us");
+
+    LevelGenerator::Pattern patterns[] = {LevelGenerator::NOISE, LevelGenerator::PLATFORMS, LevelGenerator::STAIRS};
+    for(LevelGenerator::Pattern pattern : patterns)
+    {
+        for(int num_tiles : BENCH_LEVEL_SIZES)
+        {
+            bench_level(pattern, num_tiles);
+        }
+    }
+}
+
+// Scripted input of one avatar for the walkers inputs
+struct ScriptedWalker
+{
+    float direction;
+    int ticks_until_turn;
+    int ticks_until_jump;
+};
+
+static void script_inputs(Benchmarks::SimulationSettings::Inputs mode, uint32_t *random_state, std::vector<ScriptedWalker> *walkers, GameInputList *inputs)
+{
+    for(int i = 0; i < (int)inputs->size(); i++)
+    {
+        GameInput &input = (*inputs)[i];
+        if(mode == Benchmarks::SimulationSettings::RANDOM)
+        {
+            input.current_horizontal_movement = (float)((int)(next_bench_random(random_state) % 3) - 1);
+            input.current_actions[(int)GameInput::Action::JUMP] = (next_bench_random(random_state) % 8) == 0;
+            continue;
+        }
+
+        ScriptedWalker &walker = (*walkers)[i];
+        if(--walker.ticks_until_turn <= 0)
+        {
+            walker.direction = (float)((int)(next_bench_random(random_state) % 3) - 1);
+            walker.ticks_until_turn = 30 + (int)(next_bench_random(random_state) % 90);
+        }
+        bool jump = --walker.ticks_until_jump <= 0;
+        if(jump)
+        {
+            walker.ticks_until_jump = 20 + (int)(next_bench_random(random_state) % 100);
+        }
+        input.current_horizontal_movement = walker.direction;
+        input.current_actions[(int)GameInput::Action::JUMP] = jump;
+    }
+}
+
+void Benchmarks::simulation(const SimulationSettings &settings)
+{
+    Level *level = nullptr;
+    if(settings.level_path)
+    {
+        level = new Level();
+        level->clear();
+        level->load_with_file(settings.level_path, true);
+    }
+    else
+    {
+        level = Levels::create_level(settings.level_number);
+    }
+
+    uint32_t random_state = settings.seed;
+    GameInputList inputs(settings.num_avatars);
+    std::vector<ScriptedWalker> walkers(settings.num_avatars);
+    for(int i = 0; i < settings.num_avatars; i++)
+    {
+        inputs[i].uid = i;
+        walkers[i] = {0.0f, 0, 1 + (int)(next_bench_random(&random_state) % 60)};
+    }
+    std::vector<double> tick_times(settings.num_ticks);
+
+    // Winning or falling out would stop the avatars, the mode goes back to playing before every tick
+    for(int tick = 0; tick < SIMULATION_WARMUP_TICKS; tick++)
+    {
+        script_inputs(settings.inputs, &random_state, &walkers, &inputs);
+        level->change_mode(Level::PLAYING);
+        level->step(inputs, Engine::TARGET_STEP_TIME);
+    }
+
+    int64_t allocations_before = num_allocations;
+    int64_t bytes_before = allocated_bytes;
+    double start = Platform::time_since_start();
+    for(int tick = 0; tick < settings.num_ticks; tick++)
+    {
+        double tick_start = Platform::time_since_start();
+        script_inputs(settings.inputs, &random_state, &walkers, &inputs);
+        level->change_mode(Level::PLAYING);
+        level->step(inputs, Engine::TARGET_STEP_TIME);
+        tick_times[tick] = Platform::time_since_start() - tick_start;
+    }
+    double total_time = Platform::time_since_start() - start;
+    int64_t allocations = num_allocations - allocations_before;
+    int64_t bytes = allocated_bytes - bytes_before;
+
+    std::sort(tick_times.begin(), tick_times.end());
+    int num_ticks = max(settings.num_ticks, 1);
+    double ticks_per_second = num_ticks / total_time;
+    double ns_per_avatar_tick = total_time / ((double)num_ticks * max(level->avatars.count(), 1)) * 1000000000.0;
+    double p50 = tick_times.empty() ? 0.0 : tick_times[tick_times.size() / 2];
+    double p99 = tick_times.empty() ? 0.0 : tick_times[(tick_times.size() * 99) / 100];
+    double worst = tick_times.empty() ? 0.0 : tick_times.back();
+
+    printf("%s, %i avatars, %i ticks, %s inputs, %i job workers\n", settings.level_path ? settings.level_path : level->editor.loaded_level,
+            level->avatars.count(), settings.num_ticks, settings.inputs == SimulationSettings::RANDOM ? "random" : "walkers", Jobs::num_workers());
+    printf("%12s %15s %9s %9s %9s %12s %12s\n", "ticks/sec", "ns/avatar/tick", "p50 us", "p99 us", "max us", "allocs/tick", "bytes/tick");
+    if(counting_allocations)
+    {
+        printf("%12.1f %15.1f %9.2f %9.2f %9.2f %12.2f %12.1f\n", ticks_per_second, ns_per_avatar_tick, p50 * 1000000.0,
+                p99 * 1000000.0, worst * 1000000.0, (double)allocations / num_ticks, (double)bytes / num_ticks);
+    }
+    else
+    {
+        printf("%12.1f %15.1f %9.2f %9.2f %9.2f %12s %12s\n", ticks_per_second, ns_per_avatar_tick, p50 * 1000000.0,
+                p99 * 1000000.0, worst * 1000000.0, "-", "-");
+    }
+    fflush(stdout);
+
+    Levels::destroy_level(level);
+}
@@ -0,0 +1,36 @@
+
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+
+// Run from the command line instead of the game, they print a table and the engine exits
+struct Benchmarks
+{
+    struct SimulationSettings
+    {
+        enum Inputs
+        {
+            RANDOM,  // New movement and jump chances every tick
+            WALKERS, // Each avatar holds a direction for a while and jumps every so often, closer to real play
+        };
+
+        int level_number = 1;
+        const char *level_path = nullptr; // Used instead of the level number if set
+        int num_avatars = 64;
+        int num_ticks = 10000;
+        uint32_t seed = 1;
+        Inputs inputs = WALKERS;
+    };
+
+    // Counted by the allocator of the bench_sim executable, they stay at 0 everywhere else
+    static std::atomic<int64_t> num_allocations;
+    static std::atomic<int64_t> allocated_bytes;
+    static bool counting_allocations;
+
+    // Generates levels from 1K to 10M tiles and reports how loading, stepping and drawing them scales
+    static void level_scaling();
+    // Steps a level with scripted inputs as fast as it can, without platform input or graphics, and
+    // reports ticks per second, the cost per avatar and tick and the allocations while stepping
+    static void simulation(const SimulationSettings &settings);
+};
@@ -10,11 +10,14 @@
 #include "network.h"
 
 #include "levels.h"
+#include "jobs.h"
+#include "benchmarks.h"
 
 #include <vector>
 #include <array>
 #include <map>
 #include <algorithm>
+#include <cstring>
 
 #include "imgui.h"
 
@@ -25,6 +28,7 @@ using namespace GameMath;
 Engine *Engine::instance = nullptr;
 const float Engine::TARGET_STEP_TIME = 0.01666f;
 const int Timeline::MAX_STEPS_PER_UPDATE = 10;
+const float Timeline::MIN_SLEEP_SLACK = 0.002f;
 static const int SERVER_PORT = 4242;
 const float Engine::Client::TIMEOUT = 4.0f;
 
@@ -142,15 +146,17 @@ void GameState::step(float time_step)
     frame_number++;
 }
 
-void GameState::draw()
+#if !HEADLESS
+void GameState::draw(float step_alpha)
 {
 }
+#endif
 
 void GameState::serialize(Serialization::Stream *stream, GameInput::UID uid, bool serialize)
 {
 }
 
-#if DEBUG
+#if DEBUG && !HEADLESS
 void GameState::draw_debug_ui()
 {
 }
@@ -182,7 +188,8 @@ void GameStateMenu::step(float time_step)
     GameState::step(time_step);
 }
 
-void GameStateMenu::draw()
+#if !HEADLESS
+void GameStateMenu::draw(float step_alpha)
 {
     switch(screen)
     {
@@ -295,12 +302,13 @@ void GameStateMenu::draw_join_player()
 
     menu_window_end();
 }
+#endif
 
 void GameStateMenu::serialize(Serialization::Stream *stream, GameInput::UID uid, bool serialize)
 {
 }
 
-#if DEBUG
+#if DEBUG && !HEADLESS
 void GameStateMenu::draw_debug_ui()
 {
 }
@@ -311,6 +319,7 @@ void GameStateMenu::change_menu(Screen in_screen)
     screen = in_screen;
 }
 
+#if !HEADLESS
 void GameStateMenu::menu_window_begin()
 {
     bool *p_open = NULL;
@@ -328,6 +337,7 @@ ImVec2 GameStateMenu::button_size()
     ImVec2 button_size = ImVec2(button_scalar, button_scalar * 0.25f);
     return button_size;
 }
+#endif
 
 
 
@@ -343,7 +353,7 @@ void GameStateLobby::init()
 
 void GameStateLobby::uninit()
 {
-    //Levels::destroy_level(playing_level);
+    Levels::destroy_level(level);
     level = nullptr;
 }
 
@@ -351,18 +361,17 @@ void GameState::read_input_for_level(Level *level)
 {
     inputs_this_frame.clear();
 
-    // Read input from local player
-    GameInput local_input;
-    // If we're a client, this field doesn't matter since we're sending
-    // an input list to the server, it will just discard the uid
-    local_input.uid = local_uid;
-    v2 avatar_pos = v2();
-    if(!level->avatars.empty() && level->avatars[local_uid] != nullptr)
+    // Read input from local player, a headless server doesn't have one
+    if(!Engine::instance->headless)
     {
-        avatar_pos = level->avatars[local_uid]->position;
+        GameInput local_input;
+        // If we're a client, this field doesn't matter since we're sending
+        // an input list to the server, it will just discard the uid
+        local_input.uid = local_uid;
+        v2 avatar_pos = level->get_avatar_position(local_uid);
+        local_input.read_from_local(avatar_pos);
+        inputs_this_frame.push_back(local_input);
     }
-    local_input.read_from_local(avatar_pos);
-    inputs_this_frame.push_back(local_input);
 
     // If we're a server, read inputs from all clients
     if(Engine::instance->network_mode == Engine::NetworkMode::SERVER)
@@ -381,6 +390,11 @@ void GameState::read_input_for_level(Level *level)
         // Clean out disconnected connections
         Engine::instance->server.remove_disconnected_clients();
     }
+
+    if(Engine::instance->script_inputs)
+    {
+        Engine::instance->script_inputs(&inputs_this_frame);
+    }
 }
 
 void GameStateLobby::read_input()
@@ -394,9 +408,10 @@ void GameStateLobby::step(float time_step)
     level->step(inputs_this_frame, time_step);
 }
 
-void GameStateLobby::draw()
+#if !HEADLESS
+void GameStateLobby::draw(float step_alpha)
 {
-    level->draw(local_uid);
+    level->draw(local_uid, step_alpha);
 
     if(Engine::instance->network_mode != Engine::NetworkMode::CLIENT)
     {
@@ -424,6 +439,7 @@ void GameStateLobby::draw()
         ImGui::End();
     }
 }
+#endif
 
 void GameStateLobby::serialize(Serialization::Stream *stream, GameInput::UID uid_for_client, bool serialize)
 {
@@ -454,7 +470,7 @@ void GameStateLobby::serialize(Serialization::Stream *stream, GameInput::UID uid
     }
 }
 
-#if DEBUG
+#if DEBUG && !HEADLESS
 void GameStateLobby::draw_debug_ui()
 {
     level->draw_debug_ui();
@@ -492,26 +508,33 @@ void GameStateLevel::step(float time_step)
     GameState::step(time_step);
 
 
+#if !HEADLESS
     if(Engine::instance->editing)
     {
         playing_level->editor.step(playing_level, time_step);
     }
     else
+#endif
     {
         playing_level->step(inputs_this_frame, time_step);
     }
 
 }
 
-void GameStateLevel::draw()
+#if !HEADLESS
+void GameStateLevel::draw(float step_alpha)
 {
-    playing_level->draw(local_uid);
+    // Nothing to show between the old level and the next one
+    if(Levels::loading_level()) return;
+
+    playing_level->draw(local_uid, step_alpha);
 
     if(Engine::instance->editing)
     {
         playing_level->editor.draw(playing_level);
     }
 }
+#endif
 
 void GameStateLevel::serialize(Serialization::Stream *stream, GameInput::UID uid, bool serialize)
 {
@@ -542,7 +565,7 @@ void GameStateLevel::serialize(Serialization::Stream *stream, GameInput::UID uid
     }
 }
 
-#if DEBUG
+#if DEBUG && !HEADLESS
 void GameStateLevel::draw_debug_ui()
 {
     playing_level->draw_debug_ui();
@@ -569,6 +592,14 @@ void Timeline::reset()
     step_frequency = 0.0f;
 
     next_step_time_index = 0;
+
+    seconds_since_last_draw = 0.0f;
+    draw_frequency = 0.0f;
+    next_draw_time_index = 0;
+
+    sleep_slack = MIN_SLEEP_SLACK;
+    average_oversleep = 0.0f;
+    slack_decay_step = -1;
 }
 
 void Timeline::step_with_frequency(float freq)
@@ -576,15 +607,24 @@ void Timeline::step_with_frequency(float freq)
     step_frequency = freq;
 }
 
+void Timeline::draw_with_frequency(float freq)
+{
+    draw_frequency = freq;
+}
+
 void Timeline::update()
 {
     float this_update_time = (float)Platform::time_since_start();
     float diff = this_update_time - last_update_time;
     last_update_time = this_update_time;
     seconds_since_last_step += diff;
+    seconds_since_last_draw += diff;
+
+    bool crossed_step = seconds_since_last_step >= step_frequency;
+    bool crossed_draw = draw_frequency > 0.0f && seconds_since_last_draw >= draw_frequency;
 
     // If time to do a step (i.e. timeline has crossed a step boundary)
-    if(seconds_since_last_step >= step_frequency)
+    if(crossed_step)
     {
         // Check how many step boundaries were crossed
         // (check how many steps to do this update)
@@ -595,19 +635,7 @@ void Timeline::update()
         if(num_steps_to_do <= MAX_STEPS_PER_UPDATE)
         {
             // Step the game forward n times
-            for(int i = 0; i < num_steps_to_do; i++)
-            {
-                float step_start = Platform::time_since_start();
-                Engine::do_one_step(step_frequency);
-                float step_end = Platform::time_since_start();
-
-                float step_diff = step_end - step_start;
-                step_times[next_step_time_index++] = step_diff;
-                if(next_step_time_index >= step_times.size())
-                {
-                    next_step_time_index = 0;
-                }
-            }
+            do_steps(num_steps_to_do);
 
             // Reset the timer
             seconds_since_last_step -= step_frequency * num_steps_to_do;
@@ -616,19 +644,7 @@ void Timeline::update()
         {
             // There were more steps to do than allowed, only update
             // by the max number of steps to avoid a blackhole
-            for(int i = 0; i < MAX_STEPS_PER_UPDATE; i++)
-            {
-                float step_start = Platform::time_since_start();
-                Engine::do_one_step(step_frequency);
-                float step_end = Platform::time_since_start();
-
-                float step_diff = step_end - step_start;
-                step_times[next_step_time_index++] = step_diff;
-                if(next_step_time_index >= step_times.size())
-                {
-                    next_step_time_index = 0;
-                }
-            }
+            do_steps(MAX_STEPS_PER_UPDATE);
 
             // Reset the timer to zero
             // (it doesn't make sense to only reduce it by step_frequency * num_steps_to_do
@@ -638,11 +654,91 @@ void Timeline::update()
             Log::log_warning("Exceeded max steps per timeline update");
         }
     }
+
+    // Draw at most once per update no matter how many steps were caught up on,
+    // the leftover time interpolates between the last two steps
+    if(crossed_draw)
+    {
+#if !HEADLESS
+        float step_alpha = clamp(seconds_since_last_step / step_frequency, 0.0f, 1.0f);
+
+        float draw_start = Platform::time_since_start();
+        Engine::do_one_draw(step_alpha);
+        float draw_end = Platform::time_since_start();
+
+        draw_times[next_draw_time_index++] = draw_end - draw_start;
+        if(next_draw_time_index >= draw_times.size())
+        {
+            next_draw_time_index = 0;
+        }
+#endif
+
+        seconds_since_last_draw = (seconds_since_last_draw >= draw_frequency * 2.0f) ?
+            0.0f : seconds_since_last_draw - draw_frequency;
+    }
+
+    if(!crossed_step && !crossed_draw)
+    {
+        // Timeline hasn't reached a step or draw boundary, wait for a bit
+        wait_for_next_event();
+    }
+}
+
+void Timeline::do_steps(int num_steps)
+{
+    for(int i = 0; i < num_steps; i++)
+    {
+        float step_start = Platform::time_since_start();
+        Engine::do_one_step(step_frequency);
+        float step_end = Platform::time_since_start();
+
+        float step_diff = step_end - step_start;
+        step_times[next_step_time_index++] = step_diff;
+        if(next_step_time_index >= step_times.size())
+        {
+            next_step_time_index = 0;
+        }
+    }
+}
+
+void Timeline::wait_for_next_event()
+{
+    // Sleep until just before the next step or draw boundary, the engine
+    // loop spins through the rest so it still starts on time
+    float time_until_event = step_frequency - seconds_since_last_step;
+    if(draw_frequency > 0.0f)
+    {
+        time_until_event = min(time_until_event, draw_frequency - seconds_since_last_draw);
+    }
+    float sleep_time = time_until_event - sleep_slack;
+    if(sleep_time <= 0.0f)
+    {
+        // Still bring the slack down, once per step, so an outlier can't stop us sleeping for good
+        if(slack_decay_step != next_step_time_index)
+        {
+            slack_decay_step = next_step_time_index;
+            sleep_slack = max(lerp(sleep_slack, average_oversleep * 2.0f, 0.01f), MIN_SLEEP_SLACK);
+        }
+        return;
+    }
+
+    double sleep_start = Platform::time_since_start();
+    Platform::sleep(sleep_time);
+    double sleep_end = Platform::time_since_start();
+
+    // Adapt the slack to how late the OS actually wakes us up
+    float oversleep = max((float)(sleep_end - sleep_start) - sleep_time, 0.0f);
+    average_oversleep = lerp(average_oversleep, oversleep, 0.1f);
+    if(oversleep > sleep_slack)
+    {
+        sleep_slack = oversleep;
+    }
     else
     {
-        // Timeline hasn't reached a step boundary, wait for a bit
-        // Maybe Sleep() here? Busy waiting at the moment...
+        sleep_slack = lerp(sleep_slack, average_oversleep * 2.0f, 0.01f);
     }
+    // Well under a step, or one long oversleep would leave no time to sleep in at all
+    sleep_slack = clamp(sleep_slack, MIN_SLEEP_SLACK, max(step_frequency * 0.5f, MIN_SLEEP_SLACK));
 }
 
 
@@ -728,18 +824,6 @@ void Engine::step_as_offline(GameState *game_state, float time_step)
     game_state->read_input();
 
     game_state->step(time_step);
-
-    // Do drawing
-    {
-
-        Graphics::clear_frame(v4(0.0f, 0.5f, 0.75f, 1.0f) * 0.1f);
-        Graphics::ImGuiImplementation::new_frame();
-        game_state->draw();
-        Graphics::render();
-        draw_debug_menu();
-        Graphics::ImGuiImplementation::end_frame();
-        Graphics::swap_frames();
-    }
 }
 
 void Engine::step_as_client(GameState *game_state, float time_step)
@@ -821,25 +905,6 @@ void Engine::step_as_client(GameState *game_state, float time_step)
         // Step the game forward in time
         // ...
 #endif
-
-// Draw
-        {
-            Graphics::clear_frame(v4(0.0f, 0.5f, 0.75f, 1.0f) * 0.1f);
-            Graphics::ImGuiImplementation::new_frame();
-
-            game_state_valid = instance->client.is_connected();
-            if(game_state_valid)
-            {
-                game_state->draw();
-            }
-
-            draw_debug_menu();
-
-            Graphics::render();
-
-            Graphics::ImGuiImplementation::end_frame();
-            Graphics::swap_frames();
-        }
     }
 }
 
@@ -873,19 +938,29 @@ void Engine::step_as_server(GameState *game_state, float time_step)
         }
         Serialization::free_stream(game_stream);
     }
+}
+
+#if !HEADLESS
+void Engine::do_one_draw(float step_alpha)
+{
+    if(instance->headless) return;
 
+    GameState *game_state = instance->current_game_state;
 
+    Graphics::clear_frame(v4(0.0f, 0.5f, 0.75f, 1.0f) * 0.1f);
+    Graphics::ImGuiImplementation::new_frame();
 
-    // Draw game
+    // A client only has a game state worth drawing once it's connected
+    bool game_state_valid = instance->network_mode != NetworkMode::CLIENT || instance->client.is_connected();
+    if(game_state_valid)
     {
-        Graphics::clear_frame(v4(0.0f, 0.5f, 0.75f, 1.0f) * 0.1f);
-        Graphics::ImGuiImplementation::new_frame();
-        game_state->draw();
-        Graphics::render();
-        draw_debug_menu();
-        Graphics::ImGuiImplementation::end_frame();
-        Graphics::swap_frames();
+        game_state->draw(step_alpha);
     }
+
+    Graphics::render();
+    draw_debug_menu();
+    Graphics::ImGuiImplementation::end_frame();
+    Graphics::swap_frames();
 }
 
 void Engine::draw_debug_menu()
@@ -947,10 +1022,15 @@ void Engine::draw_debug_menu()
             {
                 //ImGui::PlotHistogram("Frames", step_times.data(), step_times.size(), int values_offset = 0, const char* overlay_text = NULL, float scale_min = FLT_MAX, float scale_max = FLT_MAX, ImVec2 graph_size = ImVec2(0, 0), int stride = sizeof(float));
                 ImGui::PlotHistogram("Frames", Engine::instance->timeline->step_times.data(), Engine::instance->timeline->step_times.size(), 0, NULL, 0, 0.032f, ImVec2(500, 300));
+                ImGui::PlotHistogram("Draws", Engine::instance->timeline->draw_times.data(), Engine::instance->timeline->draw_times.size(), 0, NULL, 0, 0.032f, ImVec2(500, 300));
+                ImGui::Text("Sleep slack: %.2f ms", Engine::instance->timeline->sleep_slack * 1000.0f);
 
                 ImGui::EndTabItem();
             }
 
+            // Game states add their own tabs
+            Engine::instance->current_game_state->draw_debug_ui();
+
             ImGui::EndTabBar();
         }
 
@@ -958,12 +1038,41 @@ void Engine::draw_debug_menu()
     }
 #endif
 }
+#endif
+
+int Engine::fast_forward(int max_steps, std::function<bool()> until)
+{
+    instance->fast_forwarding = true;
+    int num_steps = 0;
+    while(num_steps < max_steps)
+    {
+        Platform::handle_os_events();
+        if(instance->running == false) break;
+
+        do_one_step(TARGET_STEP_TIME);
+        num_steps++;
+        if(until && until()) break;
+    }
+    instance->fast_forwarding = false;
+
+    // The timeline would otherwise try to catch up on the wall time the steps took
+    instance->timeline->seconds_since_last_step = 0.0f;
+    instance->timeline->last_update_time = (float)Platform::time_since_start();
+    return num_steps;
+}
 
 void Engine::do_one_step(float time_step)
 {
     GameState *current_game_state = instance->current_game_state;
 
-    if(instance->next_mode != instance->current_mode)
+    // Levels load in the background and only take over here, between steps, so nothing
+    // is in the middle of using the old one when it goes away
+    bool level_swapped = Levels::swap_in_loaded_level();
+    bool loading_level = Levels::loading_level();
+
+    // A level is only entered once the one start_level asked for is in, until then the old one would be played
+    bool entering_loading_level = instance->next_mode == GameState::Mode::PLAYING_LEVEL && loading_level;
+    if(instance->next_mode != instance->current_mode && !entering_loading_level)
     {
         current_game_state->uninit();
         delete current_game_state;
@@ -990,6 +1099,16 @@ void Engine::do_one_step(float time_step)
         assert(instance->current_mode == current_game_state->mode);
     }
 
+    if(level_swapped && instance->current_mode == GameState::Mode::PLAYING_LEVEL)
+    {
+        ((GameStateLevel *)current_game_state)->playing_level = Levels::active_level();
+    }
+    else if(loading_level && instance->current_mode == GameState::Mode::PLAYING_LEVEL)
+    {
+        // Restarting or going to the next level, the old one is over and isn't stepped or sent anymore
+        return;
+    }
+
     switch(instance->network_mode)
     {
         case NetworkMode::OFFLINE:
@@ -1065,9 +1184,6 @@ void Engine::init()
     instance->network_mode = Engine::NetworkMode::OFFLINE;
     instance->current_game_state = new GameStateMenu();
     instance->current_game_state->init();
-
-    instance->timeline->reset();
-    instance->timeline->step_with_frequency(Engine::TARGET_STEP_TIME);
 }
 
 void Engine::switch_game_state(GameState::Mode mode)
@@ -1097,24 +1213,171 @@ void Engine::shutdown()
         }
     }
 
-    Graphics::ImGuiImplementation::shutdown();
+#if !HEADLESS
+    if(!instance->headless)
+    {
+        Graphics::ImGuiImplementation::shutdown();
+    }
+#endif
+
+    Jobs::shutdown();
+    Platform::shutdown();
 }
 
 
 
-void Engine::start()
+// Out of the way of the local player and the uids the server hands out
+static const GameInput::UID BOT_UID_BASE = 1000000;
+
+// Bots get new movement and jump chances every step, seeded so runs repeat
+static uint32_t next_bot_random(uint32_t *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 16;
+}
+
+static void fast_forward_from_command_line()
+{
+    Engine::FastForwardOptions options = Engine::instance->fast_forward_options;
+
+    uint32_t random_state = 1;
+    if(options.bots > 0)
+    {
+        Engine::instance->script_inputs = [options, &random_state](GameInputList *inputs)
+        {
+            for(int i = 0; i < options.bots; i++)
+            {
+                GameInput input;
+                input.uid = BOT_UID_BASE + i;
+                input.current_horizontal_movement = (float)((int)(next_bot_random(&random_state) % 3) - 1);
+                input.current_actions[(int)GameInput::Action::JUMP] = (next_bot_random(&random_state) % 8) == 0;
+                inputs->push_back(input);
+            }
+        };
+    }
+
+    // Nothing happens in a level after it's won or lost, whether that's what --until asked for or not
+    std::function<bool()> level_over = []()
+    {
+        return Engine::instance->current_mode == GameState::PLAYING_LEVEL &&
+                Levels::active_level()->current_mode != Level::PLAYING;
+    };
+
+    Levels::start_level(options.level);
+    Engine::switch_game_state(GameState::PLAYING_LEVEL);
+
+    double start = Platform::time_since_start();
+    int num_steps = Engine::fast_forward(options.steps, level_over);
+    double wall_time = Platform::time_since_start() - start;
+    Engine::instance->script_inputs = nullptr;
+
+    static const char *mode_names[] = {"playing", "paused", "won", "lost"};
+    Level *level = Levels::active_level();
+    bool reached = options.until_mode == -1 || (int)level->current_mode == options.until_mode;
+    printf("Fast forwarded level %i by %i steps, %.1f s of play in %.3f s, %s at step %i%s\n", level->number, num_steps,
+            num_steps * Engine::TARGET_STEP_TIME, wall_time, mode_names[level->current_mode], num_steps,
+            reached ? "" : ", the --until condition wasn't reached");
+    fflush(stdout);
+}
+
+void Engine::parse_command_line(int argc, char **argv)
+{
+    for(int i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--headless") == 0)
+        {
+            instance->headless = true;
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            instance->num_threads = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--bench-levels") == 0)
+        {
+            instance->bench_levels = true;
+        }
+        else if(strcmp(argv[i], "--fast-forward") == 0 && i + 1 < argc)
+        {
+            instance->fast_forward_options.steps = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--level") == 0 && i + 1 < argc)
+        {
+            instance->fast_forward_options.level = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--bots") == 0 && i + 1 < argc)
+        {
+            instance->fast_forward_options.bots = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--until") == 0 && i + 1 < argc)
+        {
+            i++;
+            if(strcmp(argv[i], "win") == 0) instance->fast_forward_options.until_mode = Level::WIN;
+            else if(strcmp(argv[i], "loss") == 0) instance->fast_forward_options.until_mode = Level::LOSS;
+            else Log::log_warning("Unknown --until condition: %s", argv[i]);
+        }
+        else
+        {
+            Log::log_warning("Unknown command line argument: %s", argv[i]);
+        }
+    }
+
+#if HEADLESS
+    instance->headless = true;
+#endif
+}
+
+void Engine::start(int argc, char **argv)
 {
     Platform::init();
     Log::init();
     GameConsole::init();
-    Graphics::init();
+
+    init();
+    parse_command_line(argc, argv);
+    Jobs::init(instance->num_threads);
+
+#if !HEADLESS
+    if(!instance->headless)
+    {
+        Graphics::init();
+    }
+#endif
     Network::init();
     Levels::init();
 
+    if(instance->bench_levels)
+    {
+        Benchmarks::level_scaling();
+        shutdown();
+        return;
+    }
+
+    if(instance->fast_forward_options.steps > 0)
+    {
+        fast_forward_from_command_line();
+        shutdown();
+        return;
+    }
+
     //seed_random(0);
     seed_random((int)(Platform::time_since_start() * 10000.0f));
 
-    init();
+    // A headless engine is a dedicated server, go straight to hosting the lobby
+    if(instance->headless)
+    {
+        Engine::switch_game_state(GameState::LOBBY);
+        Engine::switch_network_mode(Engine::NetworkMode::SERVER);
+    }
+
+    // Start the timeline last so startup time isn't counted against the first step
+    instance->timeline->reset();
+    instance->timeline->step_with_frequency(Engine::TARGET_STEP_TIME);
+    if(!instance->headless)
+    {
+        int refresh_rate = Platform::Window::monitor_frequency();
+        if(refresh_rate <= 0) refresh_rate = 60;
+        instance->timeline->draw_with_frequency(1.0f / refresh_rate);
+    }
 
     while(instance->running)
     {
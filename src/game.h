@@ -6,6 +6,7 @@
 #include "imgui.h"
 #include <vector>
 #include <array>
+#include <functional>
 
 
 
@@ -52,9 +53,12 @@ struct GameState
 
     virtual void read_input();
     virtual void step(float time_step);
-    virtual void draw();
+#if !HEADLESS
+    // step_alpha is how far (0 to 1) the timeline is between the last step and the next
+    virtual void draw(float step_alpha);
+#endif
     virtual void serialize(Serialization::Stream *stream, GameInput::UID uid, bool serialize);
-#if DEBUG
+#if DEBUG && !HEADLESS
     virtual void draw_debug_ui();
 #endif
 
@@ -81,19 +85,23 @@ struct GameStateMenu : GameState
     void uninit();
     void read_input();
     void step(float time_step);
-    void draw();
+#if !HEADLESS
+    void draw(float step_alpha);
     void draw_main_menu();
     void draw_join_player();
+#endif
     void serialize(Serialization::Stream *stream, GameInput::UID uid, bool serialize);
-#if DEBUG
+#if DEBUG && !HEADLESS
     void draw_debug_ui();
 #endif
 
     void change_menu(Screen screen);
 
+#if !HEADLESS
     static void menu_window_begin();
     static void menu_window_end();
     static ImVec2 button_size();
+#endif
 };
 
 struct GameStateLobby: GameState
@@ -104,9 +112,11 @@ struct GameStateLobby: GameState
     void uninit();
     void read_input();
     void step(float time_step);
-    void draw();
+#if !HEADLESS
+    void draw(float step_alpha);
+#endif
     void serialize(Serialization::Stream *stream, GameInput::UID uid, bool serialize);
-#if DEBUG
+#if DEBUG && !HEADLESS
     void draw_debug_ui();
 #endif
 };
@@ -119,9 +129,11 @@ struct GameStateLevel : GameState
     void uninit();
     void read_input();
     void step(float time_step);
-    void draw();
+#if !HEADLESS
+    void draw(float step_alpha);
+#endif
     void serialize(Serialization::Stream *stream, GameInput::UID uid, bool serialize);
-#if DEBUG
+#if DEBUG && !HEADLESS
     void draw_debug_ui();
 #endif
 };
@@ -129,15 +141,31 @@ struct GameStateLevel : GameState
 struct Timeline
 {
     static const int MAX_STEPS_PER_UPDATE;
+    static const float MIN_SLEEP_SLACK;
     float seconds_since_last_step;
     float last_update_time;
     float step_frequency;
     int next_step_time_index;
     std::array<float, 120> step_times;
 
+    // Drawing is paced separately from stepping, 0 means never draw
+    float seconds_since_last_draw;
+    float draw_frequency;
+    int next_draw_time_index;
+    std::array<float, 120> draw_times;
+
+    // How early to wake up before a step boundary, grows when the OS
+    // oversleeps and slowly shrinks back when it doesn't
+    float sleep_slack;
+    float average_oversleep;
+    int slack_decay_step; // Step index the slack last decayed at while not sleeping
+
     void reset();
     void step_with_frequency(float freq);
+    void draw_with_frequency(float freq);
     void update();
+    void do_steps(int num_steps);
+    void wait_for_next_event();
 };
 
 // Engine processes game states
@@ -148,6 +176,22 @@ struct Engine
     static const float TARGET_STEP_TIME;
 
     bool running;
+    // Dedicated server without a window, nothing is drawn and there is no local player
+    bool headless = false;
+    int num_threads = 0; // For the job system, 0 uses every hardware thread
+    bool bench_levels = false; // Run Benchmarks::level_scaling and exit instead of starting the game
+    // Called after the inputs of a step were read, tools and bots add or change inputs here
+    std::function<void(GameInputList *inputs)> script_inputs;
+    bool fast_forwarding = false;
+
+    // --fast-forward on the command line plays a level as fast as possible and exits
+    struct FastForwardOptions
+    {
+        int steps = 0;
+        int level = 1;
+        int bots = 0;        // Avatars with random inputs
+        int until_mode = -1; // Level::Mode the run should end in, it stops once the level is won or lost either way
+    } fast_forward_options;
     Timeline *timeline = nullptr;
 
     enum class NetworkMode
@@ -194,9 +238,10 @@ struct Engine
 
 
 
-    static void start();
+    static void start(int argc, char **argv);
     static void stop();
     static void init();
+    static void parse_command_line(int argc, char **argv);
 
     static void switch_game_state(GameState::Mode mode);
 
@@ -208,10 +253,17 @@ struct Engine
 
     // Engine tick
     static void do_one_step(float time_step);
+    // Steps the current game state back to back instead of at real time, nothing is drawn and nothing sleeps.
+    // Stops after max_steps, or earlier once until returns true after a step. Level loads are waited on
+    // so every step plays. Returns the number of steps done.
+    static int fast_forward(int max_steps, std::function<bool()> until = nullptr);
     static void step_as_offline(GameState *game_state, float time_step);
     static void step_as_client(GameState *game_state, float time_step);
     static void step_as_server(GameState *game_state, float time_step);
+#if !HEADLESS
+    static void do_one_draw(float step_alpha);
     static void draw_debug_menu();
+#endif
 
     static void shutdown();
 
@@ -6,6 +6,7 @@
 #include "imgui.h"
 
 #include <vector>
+#include <mutex>
 #include <cstring>
 #include <cassert>
 
@@ -23,6 +24,8 @@ struct GameConsoleState
         v3 color;
     };
 
+    // Level loads on jobs log too
+    std::mutex entries_mutex;
     std::vector<Entry> entries;
 
 };
@@ -44,13 +47,16 @@ void GameConsole::write(const char *text, v3 color)
 
     strcpy(entry.text.data(), text);
 
+    std::lock_guard<std::mutex> lock(instance->entries_mutex);
     instance->entries.push_back(entry);
 }
 
+#if !HEADLESS
 void GameConsole::draw()
 {
     ImGui::BeginChild("Console", ImVec2(0, 0), true);
 
+    std::lock_guard<std::mutex> lock(instance->entries_mutex);
     for(int i = 0; i < instance->entries.size(); i++)
     {
         GameConsoleState::Entry *entry = &(instance->entries[i]);
@@ -62,4 +68,4 @@ void GameConsole::draw()
 
     ImGui::EndChild();
 }
-
+#endif
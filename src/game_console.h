@@ -11,6 +11,8 @@ struct GameConsole
 
     static void write(const char *text, GameMath::v3 color = GameMath::v3(1.0f, 1.0f, 1.0f));
 
+#if !HEADLESS
     static void draw();
+#endif
 };
 
@@ -43,7 +43,7 @@ namespace GameMath
         {
             struct { float x, y, z, w; };
             struct { float r, g, b, a; };
-            struct { float h, s, v, a; };
+            struct { float h, s, v; };
             float m[4];
         };
         v4() : x(0.0f), y(0.0f), z(0.0f), w(0.0f) { }
@@ -15,6 +15,13 @@ struct Graphics
 
     static void quad(GameMath::v2 position, GameMath::v2 scale, float rotation, GameMath::v4 color, int layer = 0);
 
+    // Quads that rarely change, packed and uploaded once then drawn every frame until cleared
+    static struct QuadCache *make_quad_cache();
+    static void free_quad_cache(QuadCache *cache);
+    static void clear_quad_cache(QuadCache *cache);
+    static void cache_quad(QuadCache *cache, GameMath::v2 position, GameMath::v2 scale, float rotation, GameMath::v4 color);
+    static void draw_quad_cache(QuadCache *cache, int layer = 0);
+
     static GameMath::mat4 view_m_world();
     static GameMath::mat4 world_m_view();
     static GameMath::mat4 ndc_m_world();
@@ -26,6 +33,8 @@ struct Graphics
 
         static GameMath::v2 &position();
         static float &width();
+        // World space rectangle the camera currently sees
+        static void view_bounds(GameMath::v2 *bl, GameMath::v2 *tr);
     };
 
     struct ImGuiImplementation
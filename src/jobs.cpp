@@ -0,0 +1,294 @@
+
+#include "jobs.h"
+#include "logging.h"
+
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+
+
+
+struct QueuedJob
+{
+    Jobs::Job job;
+    Jobs::Counter *counter;
+};
+
+struct Worker
+{
+    std::mutex mutex;
+    std::deque<QueuedJob> jobs;
+    std::thread thread;
+};
+
+struct JobsState
+{
+    std::vector<Worker *> workers;
+
+    std::mutex background_mutex;
+    std::deque<QueuedJob> background_jobs;
+
+    // Idle workers sleep until something gets queued
+    std::mutex sleep_mutex;
+    std::condition_variable wake_up;
+    std::atomic<int> num_queued;
+    std::atomic<bool> quitting;
+};
+JobsState *Jobs::instance = nullptr;
+
+static thread_local int this_worker_index = -1;
+
+
+
+static void wake_one_worker()
+{
+    Jobs::instance->num_queued++;
+    {
+        // Taking the lock makes sure a worker that's about to sleep sees the job
+        std::lock_guard<std::mutex> lock(Jobs::instance->sleep_mutex);
+    }
+    Jobs::instance->wake_up.notify_one();
+}
+
+static void push_job(QueuedJob queued)
+{
+    // Outside threads hand their jobs to the main worker, someone will steal them
+    int index = (this_worker_index >= 0) ? this_worker_index : 0;
+    Worker *worker = Jobs::instance->workers[index];
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        worker->jobs.push_back(queued);
+    }
+
+    wake_one_worker();
+}
+
+static bool pop_job(int index, QueuedJob *out)
+{
+    // Own jobs newest first, they're most likely still in cache
+    Worker *own = Jobs::instance->workers[index];
+    {
+        std::lock_guard<std::mutex> lock(own->mutex);
+        if(!own->jobs.empty())
+        {
+            *out = own->jobs.back();
+            own->jobs.pop_back();
+            Jobs::instance->num_queued--;
+            return true;
+        }
+    }
+
+    // Steal the oldest job of somebody else, starting with the next worker over
+    int num_workers = (int)Jobs::instance->workers.size();
+    for(int i = 1; i < num_workers; i++)
+    {
+        Worker *victim = Jobs::instance->workers[(index + i) % num_workers];
+        std::lock_guard<std::mutex> lock(victim->mutex);
+        if(!victim->jobs.empty())
+        {
+            *out = victim->jobs.front();
+            victim->jobs.pop_front();
+            Jobs::instance->num_queued--;
+            return true;
+        }
+    }
+
+    // Background jobs last, and never on the main thread if there's anyone else
+    if(index != 0 || num_workers == 1)
+    {
+        std::lock_guard<std::mutex> lock(Jobs::instance->background_mutex);
+        if(!Jobs::instance->background_jobs.empty())
+        {
+            *out = Jobs::instance->background_jobs.front();
+            Jobs::instance->background_jobs.pop_front();
+            Jobs::instance->num_queued--;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void finish_job(Jobs::Counter *counter)
+{
+    if(counter == nullptr) return;
+
+    // Decrement under the lock, wait takes it too before the counter can go away
+    std::vector<Jobs::Job> continuations;
+    {
+        std::lock_guard<std::mutex> lock(counter->continuations_mutex);
+        if(counter->remaining.fetch_sub(1) != 1) return;
+
+        // Last one out starts whatever was waiting on this counter
+        continuations.swap(counter->continuations);
+    }
+    for(Jobs::Job &job : continuations)
+    {
+        push_job({job, nullptr});
+    }
+}
+
+static bool run_one_job(int index)
+{
+    QueuedJob queued;
+    if(!pop_job(index, &queued)) return false;
+
+    queued.job();
+    finish_job(queued.counter);
+    return true;
+}
+
+static void worker_loop(int index)
+{
+    this_worker_index = index;
+
+    while(!Jobs::instance->quitting)
+    {
+        if(run_one_job(index)) continue;
+
+        std::unique_lock<std::mutex> lock(Jobs::instance->sleep_mutex);
+        Jobs::instance->wake_up.wait(lock, [] { return Jobs::instance->quitting || Jobs::instance->num_queued > 0; });
+    }
+}
+
+
+
+void Jobs::init(int num_threads)
+{
+    instance = new JobsState();
+    instance->num_queued = 0;
+    instance->quitting = false;
+
+    if(num_threads <= 0)
+    {
+        num_threads = (int)std::thread::hardware_concurrency();
+        if(num_threads <= 0) num_threads = 1;
+    }
+
+    // Worker 0 is the calling thread
+    for(int i = 0; i < num_threads; i++)
+    {
+        instance->workers.push_back(new Worker());
+    }
+    this_worker_index = 0;
+    for(int i = 1; i < num_threads; i++)
+    {
+        instance->workers[i]->thread = std::thread(worker_loop, i);
+    }
+
+    Log::log_info("Job system started with %i workers", num_threads);
+}
+
+void Jobs::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(instance->sleep_mutex);
+        instance->quitting = true;
+    }
+    instance->wake_up.notify_all();
+
+    for(Worker *worker : instance->workers)
+    {
+        if(worker->thread.joinable()) worker->thread.join();
+        delete worker;
+    }
+
+    delete instance;
+    instance = nullptr;
+    this_worker_index = -1;
+}
+
+int Jobs::num_workers()
+{
+    return (int)instance->workers.size();
+}
+
+int Jobs::worker_index()
+{
+    return this_worker_index;
+}
+
+void Jobs::run(Job job, Counter *counter)
+{
+    if(counter) counter->remaining++;
+    push_job({job, counter});
+}
+
+void Jobs::run_in_background(Job job, Counter *counter)
+{
+    if(counter) counter->remaining++;
+    {
+        std::lock_guard<std::mutex> lock(instance->background_mutex);
+        instance->background_jobs.push_back({job, counter});
+    }
+    wake_one_worker();
+}
+
+void Jobs::run_after(Counter *dependency, Job job, Counter *counter)
+{
+    if(counter) counter->remaining++;
+
+    // Wrap the job so it still finishes its own counter when it runs later
+    Job continuation = [job, counter]()
+    {
+        job();
+        finish_job(counter);
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(dependency->continuations_mutex);
+        if(dependency->remaining > 0)
+        {
+            dependency->continuations.push_back(continuation);
+            return;
+        }
+    }
+
+    push_job({continuation, nullptr});
+}
+
+void Jobs::wait(Counter *counter)
+{
+    assert(this_worker_index >= 0 && "Only workers can wait on jobs");
+
+    while(counter->remaining > 0)
+    {
+        if(!run_one_job(this_worker_index))
+        {
+            std::this_thread::yield();
+        }
+    }
+
+    // The last job might still be holding the counter, let it finish with it
+    std::lock_guard<std::mutex> lock(counter->continuations_mutex);
+}
+
+bool Jobs::is_done(Counter *counter)
+{
+    if(counter->remaining > 0) return false;
+
+    // Same as in wait, the last job might still be holding the counter
+    std::lock_guard<std::mutex> lock(counter->continuations_mutex);
+    return true;
+}
+
+void Jobs::parallel_for(int begin, int end, int batch_size, std::function<void(int batch_begin, int batch_end)> body)
+{
+    if(batch_size < 1) batch_size = 1;
+
+    // Not worth queueing a single batch
+    if(end - begin <= batch_size)
+    {
+        if(end > begin) body(begin, end);
+        return;
+    }
+
+    Counter counter;
+    for(int batch_begin = begin; batch_begin < end; batch_begin += batch_size)
+    {
+        int batch_end = (batch_begin + batch_size < end) ? batch_begin + batch_size : end;
+        run([&body, batch_begin, batch_end]() { body(batch_begin, batch_end); }, &counter);
+    }
+    wait(&counter);
+}
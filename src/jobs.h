@@ -0,0 +1,48 @@
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Work stealing thread pool. Every worker owns a deque, it pushes and pops
+// jobs at the back and idle workers steal from the front of the others. The
+// thread that called init is worker 0 and runs jobs while it waits on them.
+struct Jobs
+{
+    static struct JobsState *instance;
+
+    typedef std::function<void()> Job;
+
+    // Counts unfinished jobs, wait on it or make other jobs depend on it
+    struct Counter
+    {
+        std::atomic<int> remaining;
+        std::mutex continuations_mutex;
+        std::vector<Job> continuations; // Run once remaining drops to zero
+
+        Counter() : remaining(0) {}
+    };
+
+    // 0 threads uses one worker per hardware thread
+    static void init(int num_threads = 0);
+    static void shutdown();
+    static int num_workers();
+    static int worker_index(); // Of the calling thread, -1 if it isn't a worker
+
+    // counter can be null if nobody waits on the job
+    static void run(Job job, Counter *counter = nullptr);
+    // For long jobs the calling thread shouldn't get stuck with while it waits on something else.
+    // Worker 0 only picks these up when it's the only worker.
+    static void run_in_background(Job job, Counter *counter = nullptr);
+    // job only starts after everything counted by dependency finished
+    static void run_after(Counter *dependency, Job job, Counter *counter = nullptr);
+    // Runs other jobs while waiting, so it's safe to call from inside a job
+    static void wait(Counter *counter);
+    // Doesn't wait, once it returns true the counter can be freed
+    static bool is_done(Counter *counter);
+
+    // Calls body(batch_begin, batch_end) for batches of at most batch_size, returns once all are done
+    static void parallel_for(int begin, int end, int batch_size, std::function<void(int batch_begin, int batch_end)> body);
+};
@@ -0,0 +1,190 @@
+
+#include "level_generator.h"
+#include "levels.h"
+#include "jobs.h"
+
+#include <cmath>
+#include <cstring>
+
+
+
+// Rows with platforms on them, the ones in between stay empty so avatars fit
+static const int PLATFORM_SPACING = 4;
+static const int MIN_PLATFORM_LENGTH = 4;
+static const int MAX_PLATFORM_LENGTH = 32;
+// Cells until a stair pattern repeats along the diagonal
+static const int STAIR_PERIOD = 16;
+
+// Small and fast, and seeded per chunk so chunks can be generated in any order
+struct GeneratorRandom
+{
+    uint64_t state;
+
+    GeneratorRandom(uint32_t seed, Level::v2i chunk_pos)
+    {
+        state = ((uint64_t)seed << 32) ^ ((uint64_t)(uint32_t)chunk_pos.x * 0x9E3779B97F4A7C15ull) ^
+            ((uint64_t)(uint32_t)chunk_pos.y * 0xC2B2AE3D27D4EB4Full);
+        next();
+    }
+
+    // splitmix64
+    uint64_t next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    float next_01()
+    {
+        return (float)(next() >> 40) / (float)(1 << 24);
+    }
+
+    int next_range(int min, int max)
+    {
+        return min + (int)(next() % (uint64_t)(max - min + 1));
+    }
+};
+
+static uint64_t platform_row(GeneratorRandom *random, float density)
+{
+    // Platforms only cover their rows, so those are filled more to reach the density overall
+    float fill = fminf(density * PLATFORM_SPACING, 1.0f);
+    if(fill <= 0.0f) return 0;
+    float mean_length = (MIN_PLATFORM_LENGTH + MAX_PLATFORM_LENGTH) * 0.5f;
+    int max_gap = (int)(2.0f * mean_length * (1.0f - fill) / fill);
+
+    uint64_t row = 0;
+    int x = random->next_range(0, max_gap);
+    while(x < Level::Grid::CHUNK_SIZE)
+    {
+        int length = random->next_range(MIN_PLATFORM_LENGTH, MAX_PLATFORM_LENGTH);
+        for(int i = x; i < x + length && i < Level::Grid::CHUNK_SIZE; i++)
+        {
+            row |= (uint64_t)1 << i;
+        }
+        x += length + random->next_range(0, max_gap);
+    }
+    return row;
+}
+
+static void generate_chunk(const LevelGenerator::Settings &settings, int side, Level::Grid::Chunk *chunk, Level::Grid::ChunkRows *rows)
+{
+    GeneratorRandom random(settings.seed, chunk->position);
+    Level::v2i origin = chunk->cell_position(0);
+
+    for(int local_y = 0; local_y < Level::Grid::CHUNK_SIZE; local_y++)
+    {
+        int y = origin.y + local_y;
+        uint64_t filled = 0;
+
+        switch(settings.pattern)
+        {
+            case LevelGenerator::NOISE:
+            {
+                for(int local_x = 0; local_x < Level::Grid::CHUNK_SIZE; local_x++)
+                {
+                    if(random.next_01() < settings.density) filled |= (uint64_t)1 << local_x;
+                }
+                break;
+            }
+
+            case LevelGenerator::PLATFORMS:
+            {
+                if((y % PLATFORM_SPACING + PLATFORM_SPACING) % PLATFORM_SPACING == 0)
+                {
+                    filled = platform_row(&random, settings.density);
+                }
+                break;
+            }
+
+            case LevelGenerator::STAIRS:
+            {
+                int thickness = (int)(settings.density * STAIR_PERIOD + 0.5f);
+                int phase = (int)(settings.seed % STAIR_PERIOD);
+                for(int local_x = 0; local_x < Level::Grid::CHUNK_SIZE; local_x++)
+                {
+                    int diagonal = ((origin.x + local_x + y + phase) % STAIR_PERIOD + STAIR_PERIOD) % STAIR_PERIOD;
+                    if(diagonal < thickness) filled |= (uint64_t)1 << local_x;
+                }
+                break;
+            }
+        }
+
+        // Cut to the generated square, x and y in [0, side)
+        if(y >= side) filled = 0;
+        int end_x = side - origin.x;
+        if(end_x < Level::Grid::CHUNK_SIZE) filled &= (end_x <= 0) ? 0 : (((uint64_t)1 << end_x) - 1);
+
+        uint64_t win = 0;
+        if(settings.win_density > 0.0f)
+        {
+            for(int local_x = 0; local_x < Level::Grid::CHUNK_SIZE; local_x++)
+            {
+                if(((filled >> local_x) & 1) && random.next_01() < settings.win_density) win |= (uint64_t)1 << local_x;
+            }
+        }
+
+        rows->filled[local_y] = filled;
+        rows->win[local_y] = win;
+    }
+}
+
+
+
+void LevelGenerator::generate(Level *level, const Settings &settings)
+{
+    level->clear();
+    strcpy(level->editor.loaded_level, "(generated)");
+
+    int side = (int)ceil(sqrt((double)settings.num_tiles));
+    if(side < 1) side = 1;
+    // Avatars fall out below zero, so the level goes up from there
+    level->grid.start_point = Level::v2i(side / 2, side + 2);
+
+    // Chunks are added up front so the generating jobs never touch the chunk map
+    int chunks_across = (side + Level::Grid::CHUNK_SIZE - 1) >> Level::Grid::CHUNK_SIZE_BITS;
+    int num_chunks = chunks_across * chunks_across;
+    std::vector<Level::Grid::Chunk *> chunks(num_chunks);
+    for(int i = 0; i < num_chunks; i++)
+    {
+        Level::v2i chunk_pos = Level::v2i(i % chunks_across, i / chunks_across);
+        chunks[i] = level->grid.get_or_add_chunk(chunk_pos);
+        chunks[i]->edited = true; // Only exists in memory until it's written out
+    }
+
+    std::vector<Level::Grid::ChunkRows> rows(num_chunks);
+    Jobs::parallel_for(0, num_chunks, 16, [&](int batch_begin, int batch_end)
+    {
+        for(int i = batch_begin; i < batch_end; i++)
+        {
+            generate_chunk(settings, side, chunks[i], &rows[i]);
+        }
+    });
+
+    // Replacing rows also updates the grid's triggers, that's shared
+    for(int i = 0; i < num_chunks; i++)
+    {
+        level->grid.replace_rows(chunks[i], rows[i]);
+    }
+}
+
+void LevelGenerator::write(const char *path, const Settings &settings)
+{
+    Level *level = new Level();
+    generate(level, settings);
+    level->load_with_file(path, false);
+    Levels::destroy_level(level);
+}
+
+const char *LevelGenerator::pattern_name(Pattern pattern)
+{
+    switch(pattern)
+    {
+        case NOISE: return "noise";
+        case PLATFORMS: return "platforms";
+        case STAIRS: return "stairs";
+    }
+    return "unknown";
+}
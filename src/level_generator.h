@@ -0,0 +1,33 @@
+
+#pragma once
+
+#include <stdint.h>
+
+struct Level;
+
+// Makes big levels to benchmark the grid with. The same settings always make
+// the same level, every chunk is generated from the seed and its own position.
+struct LevelGenerator
+{
+    enum Pattern
+    {
+        NOISE,     // Every cell is filled with the density as its chance
+        PLATFORMS, // Runs of cells on every few rows, like the shipped levels but a lot more of them
+        STAIRS,    // Diagonal steps, lots of corners for the collision sweeps
+    };
+
+    struct Settings
+    {
+        uint32_t seed = 1;
+        int num_tiles = 100000;     // Cells in the generated square, filled or not
+        float density = 0.25f;      // Rough share of filled cells
+        float win_density = 0.001f; // Share of filled cells that win when touched
+        Pattern pattern = PLATFORMS;
+    };
+
+    // Replaces the grid of the level with a square of num_tiles cells, the avatars spawn on top of it
+    static void generate(Level *level, const Settings &settings);
+    // Writes the generated level out as a level file
+    static void write(const char *path, const Settings &settings);
+    static const char *pattern_name(Pattern pattern);
+};
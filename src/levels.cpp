@@ -7,12 +7,24 @@
 #include "data_structures.h"
 #include "graphics.h"
 #include "serialization.h"
+#include "jobs.h"
 
 #include "imgui.h"
 #include <map>
+#include <mutex>
 #include <algorithm>
 #include <cassert>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define AVATAR_SSE2 1
+#include <emmintrin.h>
+#else
+#define AVATAR_SSE2 0
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
 
 
 using namespace GameMath;
@@ -20,10 +32,42 @@ using namespace GameMath;
 
 
 #define LEVELS_DIR "assets/data/levels/"
+// A level being built by a job, or built and waiting to be started
+struct LevelLoad
+{
+    Level *level = nullptr; // Set by the job
+    Jobs::Counter counter;
+};
+
+// A level as it was read from its file, never changed after it's cached
+struct LevelTemplate
+{
+    float world_scale;
+    Level::v2i start_point;
+    Level::AvatarArrays avatars;
+    std::vector<Level::Grid::Chunk> chunks; // In allocation order, without quad caches
+    std::unordered_map<Level::v2i, std::vector<Level::Grid::Trigger>, Level::v2iHash> triggers;
+    char loaded_level[128];
+    int size;      // Counted against the cache budget
+    int last_used; // Cache use this was last instantiated or cached at
+};
+
 struct LevelsState
 {
     Level *active_level = nullptr;
 
+    std::map<int, LevelLoad *> loads;
+    int wanted_level = -1;            // Level start_level is waiting on, -1 if none
+    bool prefetch_next_level = true;  // Load the next level while the win screen is up
+
+    // Loads run on jobs, so the cache is behind a lock
+    std::mutex templates_mutex;
+    std::map<int, LevelTemplate *> templates;
+    bool cache_levels = true;
+    int templates_size = 0;
+    int templates_budget = 64 * 1024 * 1024;
+    int num_template_uses = 0;
+
     bool lobby_level_selecting = false;
 
     typedef std::map<int, char *> LevelFilesMap;
@@ -75,6 +119,61 @@ static bool aabb(v2 a_bl, v2 a_tr, v2 b_bl, v2 b_tr, v2 *dir, float *depth)
     return true;
 }
 
+// Time of impact of box a moving by move against the static box b. normal
+// points the way a gets pushed, like dir in aabb. Boxes that already overlap
+// are left to aabb and don't count as a hit.
+static bool swept_aabb(v2 a_bl, v2 a_tr, v2 move, v2 b_bl, v2 b_tr, float *time, v2 *normal)
+{
+    const float NEVER = 1e30f;
+
+    float entry_x, exit_x;
+    if(move.x > 0.0f)      { entry_x = (b_bl.x - a_tr.x) / move.x; exit_x = (b_tr.x - a_bl.x) / move.x; }
+    else if(move.x < 0.0f) { entry_x = (b_tr.x - a_bl.x) / move.x; exit_x = (b_bl.x - a_tr.x) / move.x; }
+    else
+    {
+        if(a_tr.x <= b_bl.x || a_bl.x >= b_tr.x) return false;
+        entry_x = -NEVER;
+        exit_x = NEVER;
+    }
+
+    float entry_y, exit_y;
+    if(move.y > 0.0f)      { entry_y = (b_bl.y - a_tr.y) / move.y; exit_y = (b_tr.y - a_bl.y) / move.y; }
+    else if(move.y < 0.0f) { entry_y = (b_tr.y - a_bl.y) / move.y; exit_y = (b_bl.y - a_tr.y) / move.y; }
+    else
+    {
+        if(a_tr.y <= b_bl.y || a_bl.y >= b_tr.y) return false;
+        entry_y = -NEVER;
+        exit_y = NEVER;
+    }
+
+    float entry = max(entry_x, entry_y);
+    float exit = min(exit_x, exit_y);
+    if(entry >= exit || entry < 0.0f || entry > 1.0f)
+    {
+        return false;
+    }
+
+    // Exact corner hits land on the top or bottom face
+    if(entry_x > entry_y) *normal = v2(move.x > 0.0f ? -1.0f : 1.0f, 0.0f);
+    else                  *normal = v2(0.0f, move.y > 0.0f ? -1.0f : 1.0f);
+    *time = entry;
+
+    return true;
+}
+
+
+// Index of the lowest set bit, bits must not be zero
+static int lowest_set_bit(uint64_t bits)
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return (int)index;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
 
 #pragma region Grid
 
@@ -88,32 +187,189 @@ void Level::Grid::init()
 {
 }
 
+Level::v2i Level::Grid::Chunk::cell_position(int index) const
+{
+    v2i local = v2i(index & (CHUNK_SIZE - 1), index >> CHUNK_SIZE_BITS);
+    return v2i(position.x << CHUNK_SIZE_BITS, position.y << CHUNK_SIZE_BITS) + local;
+}
+
 void Level::Grid::clear()
 {
-    cells_map.clear();
+    for(Chunk *chunk : chunks)
+    {
+#if !HEADLESS
+        if(chunk->quad_cache) Graphics::free_quad_cache(chunk->quad_cache);
+#endif
+        delete chunk;
+    }
+    chunks.clear();
+    chunks_map.clear();
+    triggers.clear();
+}
+
+const Level::Grid::Cell *Level::Grid::find(v2i pos) const
+{
+    const Chunk *chunk = find_chunk(cell_to_chunk(pos));
+    if(chunk == nullptr) return nullptr;
+    return &chunk->cells[cell_index_in_chunk(pos)];
 }
 
-Level::Grid::Cell *Level::Grid::at(v2i pos)
+const Level::Grid::Chunk *Level::Grid::find_chunk(v2i chunk_pos) const
 {
-    std::map<v2i, Cell *>::iterator it = cells_map.find(pos);
-    if(it == cells_map.end())
+    std::unordered_map<v2i, Chunk *, v2iHash>::const_iterator it = chunks_map.find(chunk_pos);
+    if(it == chunks_map.end()) return nullptr;
+    return it->second;
+}
+
+bool Level::Grid::is_filled(v2i pos) const
+{
+    const Chunk *chunk = find_chunk(cell_to_chunk(pos));
+    if(chunk == nullptr) return false;
+    int local_x = pos.x & (CHUNK_SIZE - 1);
+    int local_y = pos.y & (CHUNK_SIZE - 1);
+    return (chunk->filled_rows[local_y] >> local_x) & 1;
+}
+
+uint64_t Level::Grid::row_bits(v2i start, int count, RowFlag flag) const
+{
+    assert(count >= 0 && count <= 64);
+
+    // The span can straddle chunk borders, gather it one chunk at a time
+    uint64_t result = 0;
+    int shift = 0;
+    v2i pos = start;
+    int local_y = pos.y & (CHUNK_SIZE - 1);
+    while(shift < count)
     {
-        cells_map[pos] = new Cell();
-        return cells_map[pos];
+        int local_x = pos.x & (CHUNK_SIZE - 1);
+        int taken = min(CHUNK_SIZE - local_x, count - shift);
+
+        const Chunk *chunk = find_chunk(cell_to_chunk(pos));
+        if(chunk)
+        {
+            uint64_t word = (flag == FILLED) ? chunk->filled_rows[local_y] : chunk->win_rows[local_y];
+            word >>= local_x;
+            if(taken < 64) word &= ((uint64_t)1 << taken) - 1;
+            result |= word << shift;
+        }
+
+        shift += taken;
+        pos.x += taken;
     }
-    else
+
+    return result;
+}
+
+static void set_row_bit(uint64_t *rows, int index, bool value)
+{
+    uint64_t bit = (uint64_t)1 << (index & (Level::Grid::CHUNK_SIZE - 1));
+    uint64_t *row = &rows[index >> Level::Grid::CHUNK_SIZE_BITS];
+    if(value) *row |= bit;
+    else      *row &= ~bit;
+}
+
+void Level::Grid::replace_rows(Chunk *chunk, const ChunkRows &rows)
+{
+    bool same_filled = Platform::Memory::memcmp(chunk->filled_rows, rows.filled, sizeof(rows.filled)) == 0;
+    bool same_win = Platform::Memory::memcmp(chunk->win_rows, rows.win, sizeof(rows.win)) == 0;
+    if(same_filled && same_win)
+    {
+        return;
+    }
+
+    Platform::Memory::memcpy(chunk->filled_rows, rows.filled, sizeof(rows.filled));
+    Platform::Memory::memcpy(chunk->win_rows, rows.win, sizeof(rows.win));
+    for(int i = 0; i < CELLS_PER_CHUNK; i++)
+    {
+        uint64_t bit = (uint64_t)1 << (i & (CHUNK_SIZE - 1));
+        chunk->cells[i].filled = (rows.filled[i >> CHUNK_SIZE_BITS] & bit) != 0;
+        chunk->cells[i].win_when_touched = (rows.win[i >> CHUNK_SIZE_BITS] & bit) != 0;
+    }
+    chunk->render_dirty = true;
+    if(!same_win) rebuild_triggers(chunk);
+}
+
+void Level::Grid::set_filled(v2i pos, bool filled)
+{
+    Chunk *chunk = get_or_add_chunk(cell_to_chunk(pos));
+    int index = cell_index_in_chunk(pos);
+    chunk->cells[index].filled = filled;
+    set_row_bit(chunk->filled_rows, index, filled);
+    chunk->render_dirty = true;
+    chunk->edited = true;
+}
+
+void Level::Grid::set_win_when_touched(v2i pos, bool win_when_touched)
+{
+    Chunk *chunk = get_or_add_chunk(cell_to_chunk(pos));
+    int index = cell_index_in_chunk(pos);
+    chunk->cells[index].win_when_touched = win_when_touched;
+    set_row_bit(chunk->win_rows, index, win_when_touched);
+    chunk->render_dirty = true;
+    chunk->edited = true;
+    rebuild_triggers(chunk);
+}
+
+Level::Grid::Chunk *Level::Grid::get_or_add_chunk(v2i chunk_pos)
+{
+    std::unordered_map<v2i, Chunk *, v2iHash>::iterator it = chunks_map.find(chunk_pos);
+    if(it != chunks_map.end())
     {
         return it->second;
     }
+
+    Chunk *chunk = new Chunk();
+    chunk->position = chunk_pos;
+    for(int i = 0; i < CELLS_PER_CHUNK; i++)
+    {
+        chunk->cells[i].reset();
+    }
+    Platform::Memory::memset(chunk->filled_rows, 0, sizeof(chunk->filled_rows));
+    Platform::Memory::memset(chunk->win_rows, 0, sizeof(chunk->win_rows));
+    chunk->quad_cache = nullptr;
+    chunk->num_quads = 0;
+    chunk->render_dirty = true;
+    chunk->edited = false;
+    chunks.push_back(chunk);
+    chunks_map[chunk_pos] = chunk;
+
+    // Edits of a chunk that isn't resident have to land on top of what the file has
+    if(streamer) streamer->read_chunk(chunk);
+    return chunk;
 }
 
-v2 Level::Grid::cell_to_world(v2i pos)
+void Level::Grid::remove_chunk(Chunk *chunk)
+{
+    // Keeps the allocation order of the others, serializing walks it
+    chunks.erase(std::find(chunks.begin(), chunks.end(), chunk));
+    chunks_map.erase(chunk->position);
+    triggers.erase(chunk->position);
+#if !HEADLESS
+    if(chunk->quad_cache) Graphics::free_quad_cache(chunk->quad_cache);
+#endif
+    delete chunk;
+}
+
+// Arithmetic shifts and masks floor toward negative infinity, so negative cells land in the right chunk
+Level::v2i Level::Grid::cell_to_chunk(v2i pos)
+{
+    return v2i(pos.x >> CHUNK_SIZE_BITS, pos.y >> CHUNK_SIZE_BITS);
+}
+
+int Level::Grid::cell_index_in_chunk(v2i pos)
+{
+    int local_x = pos.x & (CHUNK_SIZE - 1);
+    int local_y = pos.y & (CHUNK_SIZE - 1);
+    return (local_y << CHUNK_SIZE_BITS) + local_x;
+}
+
+v2 Level::Grid::cell_to_world(v2i pos) const
 {
     v2 world_pos = v2((float)pos.x, (float)pos.y);
     return world_pos * world_scale;
 }
 
-Level::v2i Level::Grid::world_to_cell(v2 pos)
+Level::v2i Level::Grid::world_to_cell(v2 pos) const
 {
     pos *= (1.0f / world_scale);
     v2i cell = v2i((int)pos.x, (int)pos.y); // Should return the bottom left of a grid cell in the world
@@ -122,6 +378,174 @@ Level::v2i Level::Grid::world_to_cell(v2 pos)
     return cell;
 }
 
+static bool same_color(v4 a, v4 b)
+{
+    return a.r == b.r && a.g == b.g && a.b == b.b && a.a == b.a;
+}
+
+// Greedy meshing, takes the lowest remaining cell, widens it as far as the row allows
+// then grows it upward while the rows above have the same run in the same color.
+// Without color_of the rectangles only follow the set bits.
+static void merge_rects(Level::v2i chunk_origin, const uint64_t *rows, v4 (*color_of)(Level::v2i), std::vector<Level::Grid::Rect> *rects)
+{
+    typedef Level::v2i v2i;
+    const int CHUNK_SIZE = Level::Grid::CHUNK_SIZE;
+
+    uint64_t remaining[CHUNK_SIZE];
+    Platform::Memory::memcpy(remaining, rows, sizeof(remaining));
+
+    for(int y = 0; y < CHUNK_SIZE; y++)
+    {
+        while(remaining[y])
+        {
+            int x = lowest_set_bit(remaining[y]);
+            v2i start = chunk_origin + v2i(x, y);
+            v4 color = color_of ? color_of(start) : v4();
+
+            int width = 1;
+            while(x + width < CHUNK_SIZE &&
+                  ((remaining[y] >> (x + width)) & 1) &&
+                  (!color_of || same_color(color_of(start + v2i(width, 0)), color)))
+            {
+                width++;
+            }
+            uint64_t run = (width == 64) ? ~(uint64_t)0 : (((uint64_t)1 << width) - 1) << x;
+
+            int height = 1;
+            while(y + height < CHUNK_SIZE && (remaining[y + height] & run) == run)
+            {
+                bool matches = true;
+                for(int i = 0; i < width && matches && color_of; i++)
+                {
+                    matches = same_color(color_of(start + v2i(i, height)), color);
+                }
+                if(!matches) break;
+                height++;
+            }
+
+            for(int i = 0; i < height; i++)
+            {
+                remaining[y + i] &= ~run;
+            }
+
+            Level::Grid::Rect rect;
+            rect.position = start;
+            rect.size = v2i(width, height);
+            rect.color = color;
+            rects->push_back(rect);
+        }
+    }
+}
+
+void Level::Grid::rebuild_triggers(const Chunk *chunk)
+{
+    static thread_local std::vector<Rect> rects; // Scratch
+    rects.clear();
+    merge_rects(chunk->cell_position(0), chunk->win_rows, nullptr, &rects);
+
+    if(rects.empty())
+    {
+        triggers.erase(chunk->position);
+        return;
+    }
+
+    std::vector<Trigger> &chunk_triggers = triggers[chunk->position];
+    chunk_triggers.clear();
+    for(const Rect &rect : rects)
+    {
+        chunk_triggers.push_back({rect.position, rect.size, Trigger::WIN});
+    }
+}
+
+uint8_t Level::Grid::touched_triggers(v2 bl, v2 tr) const
+{
+    if(triggers.empty()) return 0;
+
+    // Same neighbourhood collisions look at, a trigger touching the box has a cell in it
+    v2i bl_chunk = cell_to_chunk(world_to_cell(bl) - v2i(1, 1));
+    v2i tr_chunk = cell_to_chunk(world_to_cell(tr) + v2i(1, 1));
+
+    uint8_t types = 0;
+    for(int y = bl_chunk.y; y <= tr_chunk.y; y++)
+    {
+        for(int x = bl_chunk.x; x <= tr_chunk.x; x++)
+        {
+            std::unordered_map<v2i, std::vector<Trigger>, v2iHash>::const_iterator it = triggers.find(v2i(x, y));
+            if(it == triggers.end()) continue;
+
+            for(const Trigger &trigger : it->second)
+            {
+                // The top right is worked out like the top right of its last cell so edges match exactly
+                v2 trigger_bl = cell_to_world(trigger.position);
+                v2 trigger_tr = cell_to_world(trigger.position + trigger.size - v2i(1, 1)) + v2(1.0f, 1.0f) * world_scale;
+                v2 dir;
+                float depth;
+                if(aabb(trigger_bl, trigger_tr, bl, tr, &dir, &depth))
+                {
+                    types |= trigger.types;
+                }
+            }
+        }
+    }
+
+    return types;
+}
+
+#if !HEADLESS
+// Terrain is tinted in bands of columns so neighbouring cells can share a rectangle
+static const int TERRAIN_COLOR_BAND = 8;
+
+static v4 terrain_color(Level::v2i pos)
+{
+    if(pos == Level::v2i(0, 0)) return v4(1.0f, 1.0f, 1.0f, 1.0f);
+
+    float inten = (float)(pos.x & ~(TERRAIN_COLOR_BAND - 1)) / 100.0f;
+    return v4(1.0f - inten, 0.0f, inten, 1.0f);
+}
+
+static v4 win_color(Level::v2i pos)
+{
+    return v4(0.0f, 1.0f, 0.0f, 1.0f);
+}
+
+void Level::Grid::bake_chunk(Chunk *chunk)
+{
+    static std::vector<Rect> rects; // Scratch, only the quads are kept
+    rects.clear();
+
+    // Terrain first so win tiles draw over it
+    v2i origin = chunk->cell_position(0);
+    merge_rects(origin, chunk->filled_rows, terrain_color, &rects);
+    merge_rects(origin, chunk->win_rows, win_color, &rects);
+
+    if(chunk->quad_cache == nullptr)
+    {
+        chunk->quad_cache = Graphics::make_quad_cache();
+    }
+    Graphics::clear_quad_cache(chunk->quad_cache);
+
+    float gap = world_scale * 0.05f;
+    for(const Rect &rect : rects)
+    {
+        v2 size = v2((float)rect.size.x, (float)rect.size.y) * world_scale;
+        v2 world_pos = cell_to_world(rect.position) + size / 2.0f;
+        Graphics::cache_quad(chunk->quad_cache, world_pos, size - v2(gap, gap), 0.0f, rect.color);
+    }
+
+    chunk->num_quads = (int)rects.size();
+    chunk->render_dirty = false;
+}
+#endif
+
+static bool is_empty(const Level::Grid::ChunkRows &rows)
+{
+    for(int y = 0; y < Level::Grid::CHUNK_SIZE; y++)
+    {
+        if(rows.filled[y] || rows.win[y]) return false;
+    }
+    return true;
+}
+
 void Level::Grid::serialize(Serialization::Stream *stream, bool writing)
 {
     if(writing)
@@ -129,41 +553,513 @@ void Level::Grid::serialize(Serialization::Stream *stream, bool writing)
         stream->write(world_scale);
         stream->write(start_point.x);
         stream->write(start_point.y);
-        stream->write((int)cells_map.size());
-        for(auto &pair : cells_map)
+
+        // Only chunks with something in them are written, as encoded bitboards
+        ChunkRows rows;
+        int num_chunks = 0;
+        for(Chunk *chunk : chunks)
         {
-            v2i pos = v2i(pair.first.x, pair.first.y);
-            const Cell *cell = pair.second;
+            copy_rows(chunk, &rows);
+            if(!is_empty(rows)) num_chunks++;
+        }
 
-            stream->write(pos.x);
-            stream->write(pos.y);
-            stream->write(cell->filled ? 1 : 0);
-            stream->write(cell->win_when_touched ? 1 : 0);
+        stream->write(num_chunks);
+        char encoded[MAX_ENCODED_ROWS_SIZE];
+        for(Chunk *chunk : chunks)
+        {
+            copy_rows(chunk, &rows);
+            if(is_empty(rows)) continue;
+
+            int size = encode_rows(rows, encoded);
+            stream->write(chunk->position.x);
+            stream->write(chunk->position.y);
+            stream->write(size);
+            stream->write_array(size, encoded);
         }
     }
     else
     {
-        stream->read(&world_scale);
+        float new_world_scale;
+        stream->read(&new_world_scale);
+        if(new_world_scale != world_scale)
+        {
+            // Baked quads are in world space
+            for(Chunk *chunk : chunks) chunk->render_dirty = true;
+        }
+        world_scale = new_world_scale;
         stream->read(&start_point.x);
         stream->read(&start_point.y);
-        int size;
-        stream->read(&size);
-        for(int i = 0; i < size; i++)
+
+        // Gather the incoming chunks first, clients read the whole grid every step
+        // and only the chunks that actually differ should be touched
+        std::unordered_map<v2i, ChunkRows, v2iHash> incoming;
+        int num_chunks;
+        stream->read(&num_chunks);
+        char encoded[MAX_ENCODED_ROWS_SIZE];
+        for(int i = 0; i < num_chunks; i++)
+        {
+            v2i chunk_pos;
+            int size;
+            stream->read(&chunk_pos.x);
+            stream->read(&chunk_pos.y);
+            stream->read(&size);
+            if(size < 0 || size > MAX_ENCODED_ROWS_SIZE)
+            {
+                Log::log_error("Received a broken grid chunk at %i, %i", chunk_pos.x, chunk_pos.y);
+                return;
+            }
+
+            stream->read_array(size, encoded);
+            if(!decode_rows(encoded, size, &incoming[chunk_pos]))
+            {
+                Log::log_error("Received a broken grid chunk at %i, %i", chunk_pos.x, chunk_pos.y);
+                return;
+            }
+        }
+
+        // Chunks missing from the stream are emptied, not freed
+        ChunkRows empty = {};
+        for(Chunk *chunk : chunks)
+        {
+            std::unordered_map<v2i, ChunkRows, v2iHash>::iterator it = incoming.find(chunk->position);
+            replace_rows(chunk, (it != incoming.end()) ? it->second : empty);
+        }
+        for(const std::pair<const v2i, ChunkRows> &pair : incoming)
+        {
+            if(find_chunk(pair.first)) continue;
+            replace_rows(get_or_add_chunk(pair.first), pair.second);
+        }
+    }
+
+}
+
+void Level::Grid::read_cells(Serialization::Stream *stream, int num_cells, std::unordered_map<v2i, ChunkRows, v2iHash> *incoming)
+{
+    for(int i = 0; i < num_cells; i++)
+    {
+        v2i pos;
+        stream->read(&pos.x);
+        stream->read(&pos.y);
+
+        int filled_val;
+        stream->read(&filled_val);
+        int win_when_touched;
+        stream->read(&win_when_touched);
+
+        int index = cell_index_in_chunk(pos);
+        if(filled_val != 0)
+        {
+            set_row_bit((*incoming)[cell_to_chunk(pos)].filled, index, true);
+        }
+        if(win_when_touched != 0)
+        {
+            set_row_bit((*incoming)[cell_to_chunk(pos)].win, index, true);
+        }
+    }
+}
+
+// Encoded rows are a series of runs over the 128 words of ChunkRows, each starting with a control byte:
+//   0x00-0x3f  1 to 64 zero words
+//   0x40-0x7f  1 to 64 copies of the word that follows
+//   0x80-0xff  1 to 128 words that follow as they are
+// Most rows of a chunk are empty or the same as the one before, so a chunk shrinks to a few bytes.
+static const int ENCODED_WORDS = 2 * Level::Grid::CHUNK_SIZE;
+static const uint8_t ZERO_RUN = 0x00;
+static const uint8_t REPEAT_RUN = 0x40;
+static const uint8_t LITERAL_RUN = 0x80;
+static const int MAX_SHORT_RUN = 64;
+static const int MAX_LITERAL_RUN = 128;
+
+int Level::Grid::encode_rows(const ChunkRows &rows, char *out)
+{
+    uint64_t words[ENCODED_WORDS];
+    Platform::Memory::memcpy(words, &rows, sizeof(words));
+
+    int size = 0;
+    int i = 0;
+    while(i < ENCODED_WORDS)
+    {
+        int run = 1;
+        while(i + run < ENCODED_WORDS && run < MAX_SHORT_RUN && words[i + run] == words[i]) run++;
+
+        if(words[i] == 0)
+        {
+            out[size++] = (char)(ZERO_RUN | (run - 1));
+        }
+        else if(run > 1)
+        {
+            out[size++] = (char)(REPEAT_RUN | (run - 1));
+            Platform::Memory::memcpy(out + size, &words[i], sizeof(uint64_t));
+            size += sizeof(uint64_t);
+        }
+        else
+        {
+            // Literal words up to the next zero or repeat
+            while(i + run < ENCODED_WORDS && run < MAX_LITERAL_RUN && words[i + run] != 0 &&
+                  (i + run + 1 >= ENCODED_WORDS || words[i + run] != words[i + run + 1]))
+            {
+                run++;
+            }
+            out[size++] = (char)(LITERAL_RUN | (run - 1));
+            Platform::Memory::memcpy(out + size, &words[i], run * sizeof(uint64_t));
+            size += run * sizeof(uint64_t);
+        }
+
+        i += run;
+    }
+
+    return size;
+}
+
+bool Level::Grid::decode_rows(const char *in, int size, ChunkRows *rows)
+{
+    uint64_t words[ENCODED_WORDS];
+    int i = 0;
+    int offset = 0;
+    while(offset < size)
+    {
+        uint8_t control = (uint8_t)in[offset++];
+        if(control & LITERAL_RUN)
+        {
+            int run = (control & (MAX_LITERAL_RUN - 1)) + 1;
+            int bytes = run * sizeof(uint64_t);
+            if(i + run > ENCODED_WORDS || offset + bytes > size) return false;
+            Platform::Memory::memcpy(&words[i], in + offset, bytes);
+            offset += bytes;
+            i += run;
+        }
+        else
+        {
+            int run = (control & (MAX_SHORT_RUN - 1)) + 1;
+            if(i + run > ENCODED_WORDS) return false;
+
+            uint64_t word = 0;
+            if(control & REPEAT_RUN)
+            {
+                if(offset + (int)sizeof(uint64_t) > size) return false;
+                Platform::Memory::memcpy(&word, in + offset, sizeof(uint64_t));
+                offset += sizeof(uint64_t);
+            }
+            for(int end = i + run; i < end; i++) words[i] = word;
+        }
+    }
+
+    if(i != ENCODED_WORDS) return false;
+    Platform::Memory::memcpy(rows, words, sizeof(words));
+    return true;
+}
+
+void Level::Grid::copy_rows(const Chunk *chunk, ChunkRows *rows)
+{
+    Platform::Memory::memcpy(rows->filled, chunk->filled_rows, sizeof(rows->filled));
+    Platform::Memory::memcpy(rows->win, chunk->win_rows, sizeof(rows->win));
+}
+
+#pragma endregion
+
+
+
+#pragma region ChunkStreamer
+
+// A serialized cell is its x, y, filled and win_when_touched
+static const int CELL_RECORD_SIZE = 4 * sizeof(int);
+// Cell records read at once while scanning a version 1 level file
+static const int SCAN_BATCH_CELLS = 4096;
+// uid, position and color, the same in both versions
+static const int AVATAR_RECORD_SIZE = sizeof(GameInput::UID) + sizeof(v2) + sizeof(v4);
+
+// Level files from version 2 on are laid out so chunks come straight from the mapped file: the
+// header, the avatar records, the chunk directory and then the rows of each chunk. Version 2 has
+// every chunk as a raw Grid::ChunkRows, version 3 run length encodes them where that's smaller.
+// Version 1 files are the old Level::serialize written out, they start with the avatar count instead.
+static const uint32_t LEVEL_FILE_MAGIC = 0x324c564c; // "LVL2"
+static const int LEVEL_FILE_VERSION = 3;
+
+struct LevelFileHeader
+{
+    uint32_t magic;
+    int version;
+    float world_scale;
+    int start_x;
+    int start_y;
+    int num_avatars;
+    int avatars_offset;
+    int num_chunks;
+    int directory_offset;
+    int padding;
+};
+
+struct LevelFileChunk
+{
+    int x;
+    int y;
+    int payload_offset; // 8 byte aligned so raw rows can be used in place
+    int payload_size;   // sizeof(Grid::ChunkRows) for raw rows, anything smaller is encoded. 0 in version 2
+};
+
+bool Level::ChunkStreamer::open(const char *path, Level *level)
+{
+    close();
+
+    data = Platform::FileSystem::map(path, &data_size);
+    if(data == nullptr) return false;
+
+    uint32_t magic = 0;
+    if(data_size >= (int)sizeof(magic))
+    {
+        Platform::Memory::memcpy(&magic, data, sizeof(magic));
+    }
+
+    grid = &level->grid;
+    grid->clear();
+    grid->streamer = this;
+
+    bool opened = (magic == LEVEL_FILE_MAGIC) ? open_with_directory(path, level) : open_version_1(path, level);
+    if(!opened)
+    {
+        close();
+    }
+    return opened;
+}
+
+bool Level::ChunkStreamer::open_version_1(const char *path, Level *level)
+{
+    // The avatar count and records, the world scale, start point and cell count, then the cell records
+    int num_avatars = 0;
+    if(data_size >= (int)sizeof(int))
+    {
+        Platform::Memory::memcpy(&num_avatars, data, sizeof(int));
+    }
+    int header_size = sizeof(float) + 3 * sizeof(int);
+    if(num_avatars < 0 || num_avatars > (data_size - (int)sizeof(int) - header_size) / AVATAR_RECORD_SIZE)
+    {
+        Log::log_error("Level file %s is too short", path);
+        return false;
+    }
+    int avatars_size = sizeof(int) + num_avatars * AVATAR_RECORD_SIZE;
+
+    Serialization::Stream *stream = read_range(0, avatars_size);
+    level->deserialize_avatars(stream);
+    Serialization::free_stream(stream);
+
+    int num_cells;
+    stream = read_range(avatars_size, header_size);
+    stream->read(&grid->world_scale);
+    stream->read(&grid->start_point.x);
+    stream->read(&grid->start_point.y);
+    stream->read(&num_cells);
+    Serialization::free_stream(stream);
+
+    int cells_offset = avatars_size + header_size;
+    if(num_cells < 0 || num_cells > (data_size - cells_offset) / CELL_RECORD_SIZE)
+    {
+        Log::log_error("Level file %s is too short for its %i cells", path, num_cells);
+        return false;
+    }
+
+    // The writer puts the cells of a chunk next to each other, so most chunks end up with a single run
+    Source *last_source = nullptr;
+    v2i last_chunk = v2i(0, 0);
+    for(int first = 0; first < num_cells; first += SCAN_BATCH_CELLS)
+    {
+        int batch_size = min(SCAN_BATCH_CELLS, num_cells - first);
+        stream = read_range(cells_offset + first * CELL_RECORD_SIZE, batch_size * CELL_RECORD_SIZE);
+        for(int i = 0; i < batch_size; i++)
         {
             v2i pos;
+            int filled, win_when_touched;
             stream->read(&pos.x);
             stream->read(&pos.y);
-
-            int filled_val;
-            stream->read(&filled_val);
-            int win_when_touched;
+            stream->read(&filled);
             stream->read(&win_when_touched);
 
-            bool filled = filled_val == 0 ? false : true;
-            at(pos)->filled = filled;
+            v2i chunk_pos = Grid::cell_to_chunk(pos);
+            if(last_source && chunk_pos == last_chunk)
+            {
+                last_source->runs.back().num_cells++;
+                continue;
+            }
+
+            last_source = &sources[chunk_pos];
+            last_source->runs.push_back({cells_offset + (first + i) * CELL_RECORD_SIZE, 1});
+            last_chunk = chunk_pos;
+        }
+        Serialization::free_stream(stream);
+    }
+
+    return true;
+}
+
+bool Level::ChunkStreamer::open_with_directory(const char *path, Level *level)
+{
+    LevelFileHeader header;
+    if(data_size < (int)sizeof(header))
+    {
+        Log::log_error("Level file %s is too short", path);
+        return false;
+    }
+    Platform::Memory::memcpy(&header, data, sizeof(header));
+
+    if(header.version < 2 || header.version > LEVEL_FILE_VERSION)
+    {
+        Log::log_error("Level file %s has unknown version %i", path, header.version);
+        return false;
+    }
+    bool avatars_fit = header.avatars_offset >= (int)sizeof(header) && header.avatars_offset <= data_size &&
+        header.num_avatars >= 0 && header.num_avatars <= (data_size - header.avatars_offset) / AVATAR_RECORD_SIZE;
+    bool directory_fits = header.directory_offset >= (int)sizeof(header) && header.directory_offset <= data_size &&
+        header.num_chunks >= 0 && header.num_chunks <= (data_size - header.directory_offset) / (int)sizeof(LevelFileChunk);
+    if(!avatars_fit || !directory_fits)
+    {
+        Log::log_error("Level file %s is too short", path);
+        return false;
+    }
+
+    // deserialize_avatars wants the count in front like version 1 has it
+    Serialization::Stream *stream = Serialization::make_stream(sizeof(int) + header.num_avatars * AVATAR_RECORD_SIZE);
+    stream->write(header.num_avatars);
+    stream->write_array(header.num_avatars * AVATAR_RECORD_SIZE, (char *)data + header.avatars_offset);
+    stream->move_to_beginning();
+    level->deserialize_avatars(stream);
+    Serialization::free_stream(stream);
+
+    grid->world_scale = header.world_scale;
+    grid->start_point = v2i(header.start_x, header.start_y);
+
+    // Nothing to parse, chunks point right into the mapping
+    const LevelFileChunk *directory = (const LevelFileChunk *)(data + header.directory_offset);
+    for(int i = 0; i < header.num_chunks; i++)
+    {
+        const LevelFileChunk &entry = directory[i];
+        int payload_size = (header.version == 2) ? (int)sizeof(Grid::ChunkRows) : entry.payload_size;
+        if(payload_size < 0 || payload_size > (int)sizeof(Grid::ChunkRows) ||
+           entry.payload_offset < 0 || entry.payload_offset > data_size - payload_size || (entry.payload_offset & 7) != 0)
+        {
+            Log::log_error("Level file %s has a broken chunk at %i, %i", path, entry.x, entry.y);
+            return false;
         }
+
+        Source &source = sources[v2i(entry.x, entry.y)];
+        source.payload = data + entry.payload_offset;
+        source.payload_size = payload_size;
     }
 
+    return true;
+}
+
+void Level::ChunkStreamer::close()
+{
+    if(data) Platform::FileSystem::unmap(data, data_size);
+    data = nullptr;
+    data_size = 0;
+    if(grid) grid->streamer = nullptr;
+    grid = nullptr;
+    sources.clear();
+    num_updates = 0;
+    num_paged_in = 0;
+    num_evicted = 0;
+}
+
+bool Level::ChunkStreamer::is_open()
+{
+    return data != nullptr;
+}
+
+void Level::ChunkStreamer::update()
+{
+    if(!data) return;
+    num_updates++;
+
+    for(const Area &area : areas)
+    {
+        v2i bl = Grid::cell_to_chunk(grid->world_to_cell(area.bl)) - v2i(radius, radius);
+        v2i tr = Grid::cell_to_chunk(grid->world_to_cell(area.tr)) + v2i(radius, radius);
+        for(int y = bl.y; y <= tr.y; y++)
+        {
+            for(int x = bl.x; x <= tr.x; x++)
+            {
+                std::unordered_map<v2i, Source, v2iHash>::iterator it = sources.find(v2i(x, y));
+                if(it == sources.end()) continue;
+
+                it->second.last_needed = num_updates;
+                grid->get_or_add_chunk(it->first);
+            }
+        }
+    }
+
+    int max_resident = memory_budget / (int)sizeof(Grid::Chunk);
+    if((int)grid->chunks.size() <= max_resident) return;
+
+    // Edited chunks only exist in memory, and chunks needed right now stay no matter the budget
+    evictable.clear();
+    for(Grid::Chunk *chunk : grid->chunks)
+    {
+        if(chunk->edited) continue;
+        std::unordered_map<v2i, Source, v2iHash>::iterator it = sources.find(chunk->position);
+        if(it == sources.end() || it->second.last_needed == num_updates) continue;
+        evictable.push_back({it->second.last_needed, chunk});
+    }
+
+    // Least recently needed first, ties go in allocation order so every run evicts the same chunks
+    std::stable_sort(evictable.begin(), evictable.end(),
+            [](const std::pair<int, Grid::Chunk *> &a, const std::pair<int, Grid::Chunk *> &b) { return a.first < b.first; });
+    int num_to_evict = min((int)grid->chunks.size() - max_resident, (int)evictable.size());
+    for(int i = 0; i < num_to_evict; i++)
+    {
+        grid->remove_chunk(evictable[i].second);
+        num_evicted++;
+    }
+}
+
+void Level::ChunkStreamer::page_in_all()
+{
+    for(const std::pair<const v2i, Source> &pair : sources)
+    {
+        grid->get_or_add_chunk(pair.first);
+    }
+}
+
+void Level::ChunkStreamer::read_chunk(Grid::Chunk *chunk)
+{
+    std::unordered_map<v2i, Source, v2iHash>::iterator source = sources.find(chunk->position);
+    if(source == sources.end()) return;
+    num_paged_in++;
+
+    if(source->second.payload)
+    {
+        if(source->second.payload_size == (int)sizeof(Grid::ChunkRows))
+        {
+            grid->replace_rows(chunk, *(const Grid::ChunkRows *)source->second.payload);
+            return;
+        }
+
+        Grid::ChunkRows rows;
+        if(!Grid::decode_rows(source->second.payload, source->second.payload_size, &rows))
+        {
+            Log::log_error("Level chunk at %i, %i doesn't decode", chunk->position.x, chunk->position.y);
+            return;
+        }
+        grid->replace_rows(chunk, rows);
+        return;
+    }
+
+    std::unordered_map<v2i, Grid::ChunkRows, v2iHash> incoming;
+    for(const Run &run : source->second.runs)
+    {
+        Serialization::Stream *stream = read_range(run.offset, run.num_cells * CELL_RECORD_SIZE);
+        Grid::read_cells(stream, run.num_cells, &incoming);
+        Serialization::free_stream(stream);
+    }
+
+    std::unordered_map<v2i, Grid::ChunkRows, v2iHash>::iterator it = incoming.find(chunk->position);
+    if(it != incoming.end()) grid->replace_rows(chunk, it->second);
+}
+
+Serialization::Stream *Level::ChunkStreamer::read_range(int offset, int bytes)
+{
+    Serialization::Stream *stream = Serialization::make_stream(bytes);
+    Platform::Memory::memcpy(stream->data(), data + offset, bytes);
+    return stream;
 }
 
 #pragma endregion
@@ -175,6 +1071,7 @@ void Level::Grid::serialize(Serialization::Stream *stream, bool writing)
 void Level::Avatar::reset(Level *level)
 {
     position = level->grid.cell_to_world(level->grid.start_point);
+    previous_position = position;
 
     grounded = false;
     horizontal_velocity = 0.0f;
@@ -187,13 +1084,12 @@ void Level::Avatar::reset(Level *level)
     color = random_color();
 }
 
-void Level::Avatar::step(GameInput *input, Level *level, float time_step)
+void Level::Avatar::integrate(GameInput *input, float time_step)
 {
     float horizontal_acceleration = 0.0f;
     float vertical_acceleration = 0.0f;
 
     bool jump = input->action(GameInput::Action::JUMP);
-    bool shoot = input->action(GameInput::Action::SHOOT);
 
     horizontal_acceleration += input->current_horizontal_movement * run_strength;
 
@@ -212,82 +1108,395 @@ void Level::Avatar::step(GameInput *input, Level *level, float time_step)
         //vertical_acceleration -= gravity * mass;
     }
 
-    if(shoot)
-    {
-        Log::log_info("Bang!");
-    }
-
     vertical_acceleration -= gravity * mass;
     horizontal_acceleration -= horizontal_velocity * friction_strength;
 
     horizontal_velocity += horizontal_acceleration * time_step;
     vertical_velocity += vertical_acceleration * time_step;
-    position.x += horizontal_velocity * time_step;
-    position.y += vertical_velocity * time_step;
+}
+
+uint8_t Level::Avatar::move_and_collide(Level *level, float time_step)
+{
+    // Penetration resolution picks the wrong side (or misses the tile entirely) once a step
+    // moves more than half a tile or half the avatar, sweep those moves instead
+    v2 move = v2(horizontal_velocity * time_step, vertical_velocity * time_step);
+    float max_discrete_move = 0.5f * min(full_extent, level->grid.world_scale);
+    if(level->continuous_collision && (GameMath::abs(move.x) > max_discrete_move || GameMath::abs(move.y) > max_discrete_move))
+    {
+        sweep(level, move);
+    }
+    else
+    {
+        position.x += horizontal_velocity * time_step;
+        position.y += vertical_velocity * time_step;
+    }
+
+    // Before collisions push the avatar back out, touching is enough
+    v2 half_extents = v2(1.0f, 1.0f) * full_extent * 0.5f;
+    uint8_t events = 0;
+    if(level->grid.touched_triggers(position - half_extents, position + half_extents) & Grid::Trigger::WIN)
+    {
+        events |= TOUCHED_WIN;
+    }
 
     check_and_resolve_collisions(level);
 
     if(position.y < -5.0f)
     {
-        level->change_mode(LOSS);
+        events |= FELL_OUT;
     }
+
+    return events;
 }
 
-void Level::Avatar::draw()
+int Level::AvatarArrays::count()
 {
-    Graphics::quad(position, v2(1.0f, 1.0f) * full_extent, 0.0f, color);
+    return (int)uids.size();
 }
 
-void Level::Avatar::check_and_resolve_collisions(Level *level)
+int Level::AvatarArrays::find(GameInput::UID uid)
+{
+    std::unordered_map<GameInput::UID, int>::iterator it = index_of_uid.find(uid);
+    if(it == index_of_uid.end()) return -1;
+    return it->second;
+}
+
+int Level::AvatarArrays::add(GameInput::UID uid, const Avatar &avatar)
+{
+    assert(find(uid) == -1);
+
+    int index = count();
+    uids.push_back(uid);
+    positions.push_back(avatar.position);
+    previous_positions.push_back(avatar.previous_position);
+    colors.push_back(avatar.color);
+    grounded.push_back(avatar.grounded ? 1 : 0);
+    horizontal_velocities.push_back(avatar.horizontal_velocity);
+    vertical_velocities.push_back(avatar.vertical_velocity);
+    run_strengths.push_back(avatar.run_strength);
+    friction_strengths.push_back(avatar.friction_strength);
+    masses.push_back(avatar.mass);
+    gravities.push_back(avatar.gravity);
+    full_extents.push_back(avatar.full_extent);
+    index_of_uid[uid] = index;
+
+    return index;
+}
+
+template<typename T>
+static void swap_remove(std::vector<T> *array, int index)
+{
+    (*array)[index] = array->back();
+    array->pop_back();
+}
+
+void Level::AvatarArrays::remove_at(int index)
+{
+    index_of_uid.erase(uids[index]);
+
+    // The last avatar moves into the hole
+    int last = count() - 1;
+    if(index != last)
+    {
+        index_of_uid[uids[last]] = index;
+    }
+
+    swap_remove(&uids, index);
+    swap_remove(&positions, index);
+    swap_remove(&previous_positions, index);
+    swap_remove(&colors, index);
+    swap_remove(&grounded, index);
+    swap_remove(&horizontal_velocities, index);
+    swap_remove(&vertical_velocities, index);
+    swap_remove(&run_strengths, index);
+    swap_remove(&friction_strengths, index);
+    swap_remove(&masses, index);
+    swap_remove(&gravities, index);
+    swap_remove(&full_extents, index);
+}
+
+void Level::AvatarArrays::clear()
+{
+    uids.clear();
+    positions.clear();
+    previous_positions.clear();
+    colors.clear();
+    grounded.clear();
+    horizontal_velocities.clear();
+    vertical_velocities.clear();
+    run_strengths.clear();
+    friction_strengths.clear();
+    masses.clear();
+    gravities.clear();
+    full_extents.clear();
+    index_of_uid.clear();
+}
+
+Level::Avatar Level::AvatarArrays::load(int index)
+{
+    Avatar avatar;
+    avatar.position = positions[index];
+    avatar.previous_position = previous_positions[index];
+    avatar.color = colors[index];
+    avatar.grounded = grounded[index] != 0;
+    avatar.horizontal_velocity = horizontal_velocities[index];
+    avatar.vertical_velocity = vertical_velocities[index];
+    avatar.run_strength = run_strengths[index];
+    avatar.friction_strength = friction_strengths[index];
+    avatar.mass = masses[index];
+    avatar.gravity = gravities[index];
+    avatar.full_extent = full_extents[index];
+    return avatar;
+}
+
+void Level::AvatarArrays::store(int index, const Avatar &avatar)
+{
+    positions[index] = avatar.position;
+    previous_positions[index] = avatar.previous_position;
+    colors[index] = avatar.color;
+    grounded[index] = avatar.grounded ? 1 : 0;
+    horizontal_velocities[index] = avatar.horizontal_velocity;
+    vertical_velocities[index] = avatar.vertical_velocity;
+    run_strengths[index] = avatar.run_strength;
+    friction_strengths[index] = avatar.friction_strength;
+    masses[index] = avatar.mass;
+    gravities[index] = avatar.gravity;
+    full_extents[index] = avatar.full_extent;
+}
+
+#if !HEADLESS
+v2 Level::AvatarArrays::interpolated_position(int index, float step_alpha)
+{
+    return lerp(previous_positions[index], positions[index], step_alpha);
+}
+#endif
+
+// Same math as Avatar::integrate, operation for operation, so results match it bit for bit
+static void integrate_avatars_scalar(Level::AvatarArrays *avatars, const float *movements, const uint8_t *jumps,
+                                     int begin, int end, float time_step)
+{
+    for(int i = begin; i < end; i++)
+    {
+        float horizontal_acceleration = 0.0f;
+        float vertical_acceleration = 0.0f;
+
+        horizontal_acceleration += movements[i] * avatars->run_strengths[i];
+
+        if(avatars->grounded[i])
+        {
+            avatars->vertical_velocities[i] = 0.0f;
+
+            if(jumps[i])
+            {
+                avatars->vertical_velocities[i] = 20.0f;
+                avatars->grounded[i] = 0;
+            }
+        }
+
+        vertical_acceleration -= avatars->gravities[i] * avatars->masses[i];
+        horizontal_acceleration -= avatars->horizontal_velocities[i] * avatars->friction_strengths[i];
+
+        avatars->horizontal_velocities[i] += horizontal_acceleration * time_step;
+        avatars->vertical_velocities[i] += vertical_acceleration * time_step;
+    }
+}
+
+#if AVATAR_SSE2
+// Four avatars per iteration, returns the first index left for the scalar path
+static int integrate_avatars_sse2(Level::AvatarArrays *avatars, const float *movements, const uint8_t *jumps,
+                                  int count, float time_step)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 jump_velocity = _mm_set1_ps(20.0f);
+    const __m128 dt = _mm_set1_ps(time_step);
+
+    int i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        __m128 movement            = _mm_loadu_ps(movements + i);
+        __m128 run_strength        = _mm_loadu_ps(avatars->run_strengths.data() + i);
+        __m128 friction_strength   = _mm_loadu_ps(avatars->friction_strengths.data() + i);
+        __m128 mass                = _mm_loadu_ps(avatars->masses.data() + i);
+        __m128 gravity             = _mm_loadu_ps(avatars->gravities.data() + i);
+        __m128 horizontal_velocity = _mm_loadu_ps(avatars->horizontal_velocities.data() + i);
+        __m128 vertical_velocity   = _mm_loadu_ps(avatars->vertical_velocities.data() + i);
+
+        const uint8_t *grounded = avatars->grounded.data() + i;
+        __m128 grounded_mask = _mm_castsi128_ps(_mm_cmpgt_epi32(
+                    _mm_setr_epi32(grounded[0], grounded[1], grounded[2], grounded[3]), _mm_setzero_si128()));
+        __m128 jump_mask = _mm_castsi128_ps(_mm_cmpgt_epi32(
+                    _mm_setr_epi32(jumps[i], jumps[i + 1], jumps[i + 2], jumps[i + 3]), _mm_setzero_si128()));
+
+        __m128 horizontal_acceleration = _mm_add_ps(zero, _mm_mul_ps(movement, run_strength));
+
+        // Grounded avatars stop falling, and the ones that jump get launched and leave the ground
+        vertical_velocity = _mm_andnot_ps(grounded_mask, vertical_velocity);
+        __m128 launch_mask = _mm_and_ps(grounded_mask, jump_mask);
+        vertical_velocity = _mm_or_ps(_mm_andnot_ps(launch_mask, vertical_velocity), _mm_and_ps(launch_mask, jump_velocity));
+        grounded_mask = _mm_andnot_ps(launch_mask, grounded_mask);
+
+        __m128 vertical_acceleration = _mm_sub_ps(zero, _mm_mul_ps(gravity, mass));
+        horizontal_acceleration = _mm_sub_ps(horizontal_acceleration, _mm_mul_ps(horizontal_velocity, friction_strength));
+
+        horizontal_velocity = _mm_add_ps(horizontal_velocity, _mm_mul_ps(horizontal_acceleration, dt));
+        vertical_velocity = _mm_add_ps(vertical_velocity, _mm_mul_ps(vertical_acceleration, dt));
+
+        _mm_storeu_ps(avatars->horizontal_velocities.data() + i, horizontal_velocity);
+        _mm_storeu_ps(avatars->vertical_velocities.data() + i, vertical_velocity);
+        int grounded_bits = _mm_movemask_ps(grounded_mask);
+        for(int lane = 0; lane < 4; lane++)
+        {
+            avatars->grounded[i + lane] = (grounded_bits >> lane) & 1;
+        }
+    }
+
+    return i;
+}
+#endif
+
+void Level::integrate_avatars(GameInputList &inputs, std::vector<int> &input_of_avatar, float time_step)
+{
+    int count = avatars.count();
+
+    // Pack the inputs the same way as the avatar state
+    step_movements.resize(count);
+    step_jumps.resize(count);
+    for(int i = 0; i < count; i++)
+    {
+        GameInput *input = &inputs[input_of_avatar[i]];
+        step_movements[i] = input->current_horizontal_movement;
+        step_jumps[i] = input->action(GameInput::Action::JUMP) ? 1 : 0;
+    }
+
+#if DEBUG
+    // Check the batch path against stepping each avatar on its own
+    std::vector<Avatar> expected(count);
+    for(int i = 0; i < count; i++)
+    {
+        expected[i] = avatars.load(i);
+        expected[i].integrate(&inputs[input_of_avatar[i]], time_step);
+    }
+#endif
+
+    int first_scalar = 0;
+#if AVATAR_SSE2
+    first_scalar = integrate_avatars_sse2(&avatars, step_movements.data(), step_jumps.data(), count, time_step);
+#endif
+    integrate_avatars_scalar(&avatars, step_movements.data(), step_jumps.data(), first_scalar, count, time_step);
+
+#if DEBUG
+    for(int i = 0; i < count; i++)
+    {
+        bool matches =
+            Platform::Memory::memcmp(&expected[i].horizontal_velocity, &avatars.horizontal_velocities[i], sizeof(float)) == 0 &&
+            Platform::Memory::memcmp(&expected[i].vertical_velocity, &avatars.vertical_velocities[i], sizeof(float)) == 0 &&
+            expected[i].grounded == (avatars.grounded[i] != 0);
+        if(!matches)
+        {
+            Log::log_error("Batched integration of avatar %i doesn't match Avatar::integrate", i);
+            assert(false);
+        }
+    }
+#endif
+}
+
+bool Level::Avatar::time_of_impact(Level *level, v2 move, float *time, v2 *normal)
 {
     v2 avatar_bl = position - v2(1.0f, 1.0f) * full_extent * 0.5f;
     v2 avatar_tr = position + v2(1.0f, 1.0f) * full_extent * 0.5f;
 
-    std::vector<float> rights;
-    std::vector<float> lefts;
-    std::vector<float> ups;
-    std::vector<float> downs;
-    bool won_level = false;
+    // Every tile the box can touch on the way is inside the bounds of the start and end boxes
+    v2 end_bl = avatar_bl + move;
+    v2 end_tr = avatar_tr + move;
+    v2i bl = level->grid.world_to_cell(v2(min(avatar_bl.x, end_bl.x), min(avatar_bl.y, end_bl.y))) - v2i(1, 1);
+    v2i tr = level->grid.world_to_cell(v2(max(avatar_tr.x, end_tr.x), max(avatar_tr.y, end_tr.y))) + v2i(1, 1);
 
-    v2i bl = level->grid.world_to_cell(avatar_bl) - v2i(1, 1);
-    v2i tr = level->grid.world_to_cell(avatar_tr) + v2i(1, 1);
-    for(v2i pos = bl; pos.y <= tr.y; pos.y++)
+    bool hit = false;
+    *time = 1.0f;
+    for(int y = bl.y; y <= tr.y; y++)
     {
-        for(pos.x = bl.x; pos.x <= tr.x; pos.x++)
+        for(int x = bl.x; x <= tr.x; x += 64)
         {
-            if(level->grid.at(pos) == nullptr) continue;
-
-            if(level->grid.at(pos)->filled)
+            int count = min(tr.x - x + 1, 64);
+            uint64_t filled_bits = level->grid.row_bits(v2i(x, y), count, Grid::FILLED);
+            while(filled_bits)
             {
-                v2 cell_world_position = level->grid.cell_to_world(pos);
-                v2 cell_bl = cell_world_position;
-                v2 cell_tr = cell_world_position + v2(1.0f, 1.0f) * level->grid.world_scale;
-                v2 dir;
-                float depth;
-                bool collision = aabb(cell_bl, cell_tr, avatar_bl, avatar_tr, &dir, &depth);
-                if(collision)
-                {
-                    bool blocked = false;
-                    v2 n_dir = normalize(dir);
-                    v2i dir_i = v2i((int)(n_dir.x), (int)(n_dir.y));
-                    v2i pos_in_question = pos + dir_i;
-                    if(level->grid.at(pos_in_question) && level->grid.at(pos_in_question)->filled)
-                    {
-                        blocked = true;
-                    }
+                v2i pos = v2i(x + lowest_set_bit(filled_bits), y);
+                filled_bits &= filled_bits - 1;
 
-                    if(!blocked)
-                    {
-                        if(dir_i.x ==  1 && dir_i.y ==  0) rights.push_back(depth);
-                        if(dir_i.x == -1 && dir_i.y ==  0) lefts.push_back(depth);
-                        if(dir_i.x ==  0 && dir_i.y ==  1) ups.push_back(depth);
-                        if(dir_i.x ==  0 && dir_i.y == -1) downs.push_back(depth);
-                    }
+                v2 cell_bl = level->grid.cell_to_world(pos);
+                v2 cell_tr = cell_bl + v2(1.0f, 1.0f) * level->grid.world_scale;
+                float cell_time;
+                v2 cell_normal;
+                if(!swept_aabb(avatar_bl, avatar_tr, move, cell_bl, cell_tr, &cell_time, &cell_normal)) continue;
+
+                // Faces shared with another filled tile can't be hit
+                v2i pos_in_question = pos + v2i((int)cell_normal.x, (int)cell_normal.y);
+                if(level->grid.is_filled(pos_in_question)) continue;
+
+                if(cell_time < *time || !hit)
+                {
+                    *time = cell_time;
+                    *normal = cell_normal;
+                    hit = true;
                 }
             }
+        }
+    }
+
+    return hit;
+}
+
+void Level::Avatar::sweep(Level *level, v2 move)
+{
+    // How far to sink into a tile that was hit so check_and_resolve_collisions sees the contact
+    float skin = 0.001f * level->grid.world_scale;
+
+    // Slide along whatever gets hit, a corner can stop motion on both axes
+    for(int i = 0; i < 3; i++)
+    {
+        float time;
+        v2 normal;
+        if(!time_of_impact(level, move, &time, &normal))
+        {
+            position += move;
+            return;
+        }
+
+        position += move * time;
+        position -= normal * skin;
+
+        move *= (1.0f - time);
+        if(normal.x != 0.0f) move.x = 0.0f;
+        if(normal.y != 0.0f) move.y = 0.0f;
+    }
+}
+
+void Level::Avatar::check_and_resolve_collisions(Level *level)
+{
+    v2 avatar_bl = position - v2(1.0f, 1.0f) * full_extent * 0.5f;
+    v2 avatar_tr = position + v2(1.0f, 1.0f) * full_extent * 0.5f;
 
-            if(level->grid.at(pos)->win_when_touched)
+    float max_right = 0.0f;
+    float max_left = 0.0f;
+    float max_up = 0.0f;
+    float max_down = 0.0f;
+
+    // Pull whole rows of the span out of the bitboards and only visit the cells that have something in them
+    v2i bl = level->grid.world_to_cell(avatar_bl) - v2i(1, 1);
+    v2i tr = level->grid.world_to_cell(avatar_tr) + v2i(1, 1);
+    for(int y = bl.y; y <= tr.y; y++)
+    {
+        for(int x = bl.x; x <= tr.x; x += 64)
+        {
+            int count = min(tr.x - x + 1, 64);
+            uint64_t filled_bits = level->grid.row_bits(v2i(x, y), count, Grid::FILLED);
+
+            while(filled_bits)
             {
+                v2i pos = v2i(x + lowest_set_bit(filled_bits), y);
+                filled_bits &= filled_bits - 1;
+
                 v2 cell_world_position = level->grid.cell_to_world(pos);
                 v2 cell_bl = cell_world_position;
                 v2 cell_tr = cell_world_position + v2(1.0f, 1.0f) * level->grid.world_scale;
@@ -296,21 +1505,28 @@ void Level::Avatar::check_and_resolve_collisions(Level *level)
                 bool collision = aabb(cell_bl, cell_tr, avatar_bl, avatar_tr, &dir, &depth);
                 if(collision)
                 {
-                    won_level = true;
+                    bool blocked = false;
+                    v2 n_dir = normalize(dir);
+                    v2i dir_i = v2i((int)(n_dir.x), (int)(n_dir.y));
+                    v2i pos_in_question = pos + dir_i;
+                    if(level->grid.is_filled(pos_in_question))
+                    {
+                        blocked = true;
+                    }
+
+                    if(!blocked)
+                    {
+                        if(dir_i.x ==  1 && dir_i.y ==  0) max_right = max(depth, max_right);
+                        if(dir_i.x == -1 && dir_i.y ==  0) max_left  = max(depth, max_left);
+                        if(dir_i.x ==  0 && dir_i.y ==  1) max_up    = max(depth, max_up);
+                        if(dir_i.x ==  0 && dir_i.y == -1) max_down  = max(depth, max_down);
+                    }
                 }
             }
         }
     }
 
     v2 resolution = v2();
-    float max_right = 0.0f;
-    float max_left = 0.0f;
-    float max_up = 0.0f;
-    float max_down = 0.0f;
-    for(int i = 0; i < rights.size(); i++) { max_right = max(rights[i], max_right); }
-    for(int i = 0; i < lefts.size(); i++)  { max_left  = max(lefts[i], max_left); }
-    for(int i = 0; i < ups.size(); i++)    { max_up    = max(ups[i], max_up); }
-    for(int i = 0; i < downs.size(); i++)  { max_down  = max(downs[i], max_down); }
     resolution += v2( 1.0f,  0.0f) * max_right;
     resolution += v2(-1.0f,  0.0f) * max_left;
     resolution += v2( 0.0f,  1.0f) * max_up;
@@ -334,10 +1550,113 @@ void Level::Avatar::check_and_resolve_collisions(Level *level)
     {
         horizontal_velocity = 0.0f;
     }
+}
+
+#pragma endregion
+
+
+
+#pragma region AvatarHash
+
+void Level::AvatarHash::clear()
+{
+    entries.clear();
+    buckets.clear();
+    max_half_extent = 0.0f;
+}
+
+Level::v2i Level::AvatarHash::world_to_cell(v2 pos)
+{
+    pos *= (1.0f / cell_size);
+    v2i cell = v2i((int)pos.x, (int)pos.y);
+    if(pos.x < 0.0f) cell.x -= 1;
+    if(pos.y < 0.0f) cell.y -= 1;
+    return cell;
+}
+
+int Level::AvatarHash::bucket_of(v2i cell)
+{
+    return (int)(v2iHash()(cell) & (buckets.size() - 1));
+}
+
+void Level::AvatarHash::build(AvatarArrays &avatars)
+{
+    entries.clear();
+    max_half_extent = 0.0f;
+
+    // Keep the table at least twice the avatar count so buckets stay short
+    int num_buckets = 64;
+    while(num_buckets < avatars.count() * 2) num_buckets *= 2;
+    buckets.assign(num_buckets, -1);
+
+    for(int i = 0; i < avatars.count(); i++)
+    {
+        Entry entry;
+        entry.position = avatars.positions[i];
+        entry.half_extent = avatars.full_extents[i] * 0.5f;
+        max_half_extent = max(max_half_extent, entry.half_extent);
+
+        entry.cell = world_to_cell(entry.position);
+        int bucket = bucket_of(entry.cell);
+        entry.next = buckets[bucket];
+        buckets[bucket] = (int)entries.size();
+        entries.push_back(entry);
+    }
+}
+
+void Level::AvatarHash::gather(v2 bl, v2 tr)
+{
+    found.clear();
+    if(entries.empty()) return;
+
+    // An avatar can reach out of its cell by up to its half extent
+    v2 reach = v2(1.0f, 1.0f) * max_half_extent;
+    v2i cell_bl = world_to_cell(bl - reach);
+    v2i cell_tr = world_to_cell(tr + reach);
+    for(v2i cell = cell_bl; cell.y <= cell_tr.y; cell.y++)
+    {
+        for(cell.x = cell_bl.x; cell.x <= cell_tr.x; cell.x++)
+        {
+            // Different cells can share a bucket, only take the entries of this one
+            for(int i = buckets[bucket_of(cell)]; i != -1; i = entries[i].next)
+            {
+                const Entry &entry = entries[i];
+                if(!(entry.cell == cell)) continue;
+
+                v2 half = v2(1.0f, 1.0f) * entry.half_extent;
+                v2 avatar_bl = entry.position - half;
+                v2 avatar_tr = entry.position + half;
+                if(avatar_tr.x < bl.x || avatar_bl.x > tr.x) continue;
+                if(avatar_tr.y < bl.y || avatar_bl.y > tr.y) continue;
+
+                found.push_back(i);
+            }
+        }
+    }
+
+    // Bucket chains run newest first, put results back in avatar order
+    std::sort(found.begin(), found.end());
+}
 
-    if(won_level)
+void Level::AvatarHash::query_range(v2 bl, v2 tr, std::vector<int> *results)
+{
+    gather(bl, tr);
+    results->insert(results->end(), found.begin(), found.end());
+}
+
+void Level::AvatarHash::query_pairs(float margin, std::vector<std::pair<int, int>> *pairs)
+{
+    for(int i = 0; i < (int)entries.size(); i++)
     {
-        level->change_mode(Level::Mode::WIN);
+        const Entry &entry = entries[i];
+        v2 half = v2(1.0f, 1.0f) * (entry.half_extent + margin);
+        gather(entry.position - half, entry.position + half);
+        for(int j : found)
+        {
+            // Only report each pair from its lower entry
+            if(j <= i) continue;
+            pairs->push_back(std::make_pair(i, j));
+        }
     }
 }
 
@@ -345,8 +1664,11 @@ void Level::Avatar::check_and_resolve_collisions(Level *level)
 
 
 
+#if !HEADLESS
 void Level::Editor::step(Level *level, float time_step)
 {
+    level->update_streaming();
+
     int x;
     int y;
     Platform::Input::mouse_screen_position(&x, &y);
@@ -376,7 +1698,6 @@ void Level::Editor::step(Level *level, float time_step)
             level->grid.start_point = grid_pos;
         }
     }
-    Graphics::quad(level->grid.cell_to_world(level->grid.start_point), v2(1.0f, 1.0f), 0.0f, v4(0.0f, 1.0f, 0.0f, 1.0f));
 
     // Place terrain
     if(placing_terrain && allow_placement)
@@ -385,14 +1706,14 @@ void Level::Editor::step(Level *level, float time_step)
         {
             v2 pos = Platform::Input::mouse_world_position();
             v2i grid_pos = level->grid.world_to_cell(pos);
-            level->grid.at(grid_pos)->filled = true;
+            level->grid.set_filled(grid_pos, true);
         }
 
         if(Platform::Input::key(Platform::Input::Key::SHIFT) && Platform::Input::mouse_button(0))
         {
             v2 pos = Platform::Input::mouse_world_position();
             v2i grid_pos = level->grid.world_to_cell(pos);
-            level->grid.at(grid_pos)->filled = false;
+            level->grid.set_filled(grid_pos, false);
         }
     }
 
@@ -402,14 +1723,14 @@ void Level::Editor::step(Level *level, float time_step)
         {
             v2 pos = Platform::Input::mouse_world_position();
             v2i grid_pos = level->grid.world_to_cell(pos);
-            level->grid.at(grid_pos)->win_when_touched = true;
+            level->grid.set_win_when_touched(grid_pos, true);
         }
 
         if(Platform::Input::key(Platform::Input::Key::SHIFT) && Platform::Input::mouse_button(0))
         {
             v2 pos = Platform::Input::mouse_world_position();
             v2i grid_pos = level->grid.world_to_cell(pos);
-            level->grid.at(grid_pos)->win_when_touched = false;
+            level->grid.set_win_when_touched(grid_pos, false);
         }
     }
 
@@ -422,6 +1743,8 @@ void Level::Editor::step(Level *level, float time_step)
 
 void Level::Editor::draw(Level *level)
 {
+    Graphics::quad(level->grid.cell_to_world(level->grid.start_point), v2(1.0f, 1.0f), 0.0f, v4(0.0f, 1.0f, 0.0f, 1.0f));
+
     ImGui::Begin("Editor");
 
     draw_file_menu(level);
@@ -545,11 +1868,17 @@ void Level::Editor::draw_file_menu(Level *level)
         ImGui::EndPopup();
     }
 }
+#endif
 
 
 
 void Level::step(GameInputList inputs, float time_step)
 {
+    update_streaming();
+
+    // Remember the last state so drawing can interpolate toward the new one
+    avatars.previous_positions = avatars.positions;
+
     switch(current_mode)
     {
         case PLAYING: { playing_step(inputs, time_step); break; }
@@ -559,35 +1888,45 @@ void Level::step(GameInputList inputs, float time_step)
     }
 }
 
-void Level::draw(GameInput::UID local_uid)
+#if !HEADLESS
+void Level::draw(GameInput::UID local_uid, float step_alpha)
 {
     switch(current_mode)
     {
-        case PLAYING: { playing_draw(local_uid); break; }
-        case PAUSED:  { paused_draw(local_uid); break; }
-        case WIN:     { win_draw(local_uid); break; }
-        case LOSS:    { loss_draw(local_uid); break; }
+        case PLAYING: { playing_draw(local_uid, step_alpha); break; }
+        case PAUSED:  { paused_draw(local_uid, step_alpha); break; }
+        case WIN:     { win_draw(local_uid, step_alpha); break; }
+        case LOSS:    { loss_draw(local_uid, step_alpha); break; }
     }
 
 }
+#endif
 
 void Level::serialize(Serialization::Stream *stream)
 {
-    stream->write((int)avatars.size());
-    for(const std::pair<GameInput::UID, Avatar *> &pair : avatars)
+    stream->write(avatars.count());
+    for(int i = 0; i < avatars.count(); i++)
     {
-        GameInput::UID uid = pair.first;
-        Avatar *avatar = pair.second;
-
-        stream->write(uid);
-        stream->write(avatar->position);
-        stream->write(avatar->color);
+        stream->write(avatars.uids[i]);
+        stream->write(avatars.positions[i]);
+        stream->write(avatars.colors[i]);
     }
 
     grid.serialize(stream, true);
 }
 
 void Level::deserialize(Serialization::Stream *stream)
+{
+    // The grid comes from the stream from now on, not from the level file
+    chunk_streamer.close();
+
+    deserialize_avatars(stream);
+
+    // Reads replace the grid contents in place, so chunks that didn't change keep their baked quads
+    grid.serialize(stream, false);
+}
+
+void Level::deserialize_avatars(Serialization::Stream *stream)
 {
     int num_avatars;
     stream->read(&num_avatars);
@@ -598,43 +1937,29 @@ void Level::deserialize(Serialization::Stream *stream)
         stream->read((int *)&uid);
         uids_seen.push_back(uid);
 
-        Avatar *avatar = nullptr;
-        auto it = avatars.find(uid);
-        if(it == avatars.end())
+        int index = avatars.find(uid);
+        bool new_avatar = false;
+        if(index == -1)
         {
-            avatar = add_avatar(uid);
+            index = add_avatar(uid);
+            new_avatar = true;
         }
-        else
+        avatars.previous_positions[index] = avatars.positions[index];
+        stream->read(&avatars.positions[index]);
+        stream->read(&avatars.colors[index]);
+        if(new_avatar)
         {
-            avatar = it->second;
+            avatars.previous_positions[index] = avatars.positions[index];
         }
-        stream->read(&avatar->position);
-        stream->read(&avatar->color);
     }
 
     // Remove "dangling" avatars
-    // TODO: Fix this along with sync'ing avatars in step function (1/1/2021)
-    std::vector<GameInput::UID> uids_to_remove;
-    for(const std::pair<GameInput::UID, Avatar *> &pair : avatars)
-    {
-        auto it = std::find_if(uids_seen.begin(), uids_seen.end(), [&](const GameInput::UID &other_uid) { return other_uid == pair.first; });
-        if(it == uids_seen.end())
-        {
-            uids_to_remove.push_back(pair.first);
-        }
-    }
-    while(uids_to_remove.size() > 0)
+    std::vector<uint8_t> seen(avatars.count(), 0);
+    for(GameInput::UID uid : uids_seen)
     {
-        remove_avatar(uids_to_remove.back());
-        uids_to_remove.pop_back();
+        seen[avatars.find(uid)] = 1;
     }
-
-    // TODO:
-    // Here, we clear the map each time we need to serialize because we only set filled blocks,
-    // without clearing ones that aren't set in the stream
-    // This should be made to work as a diff fix thingy
-    grid.clear();
-    grid.serialize(stream, false);
+    remove_unseen_avatars(seen);
 }
 
 void Level::clear()
@@ -644,20 +1969,47 @@ void Level::clear()
     grid.init();
     grid.world_scale = 1.0f;
     grid.clear();
+    chunk_streamer.close();
 
     avatars.clear();
+    avatar_hash.clear();
 }
 
 void Level::init(int level_num)
 {
     clear();
 
+    if(Levels::instantiate_cached_level(level_num, this))
+    {
+        number = level_num;
+        return;
+    }
+
     LevelsState::LevelFilesMap::iterator it = Levels::instance->level_files.find(level_num);
     if(it != Levels::instance->level_files.end())
     {
         char *path = it->second;
         load_with_file(path, true);
         number = level_num;
+
+        // All of a level that fits the streaming budget ends up resident anyways, read it now so it can be cached
+        if(chunk_streamer.is_open() && (int)chunk_streamer.sources.size() * (int)sizeof(Grid::Chunk) <= chunk_streamer.memory_budget)
+        {
+            chunk_streamer.page_in_all();
+            chunk_streamer.close();
+        }
+
+        if(!chunk_streamer.is_open())
+        {
+            Levels::cache_level(level_num, this);
+        }
+        else
+        {
+            // What the avatars spawn into is resident before the first step
+            v2 spawn = grid.cell_to_world(grid.start_point);
+            chunk_streamer.areas.assign(1, {spawn, spawn});
+            chunk_streamer.update();
+        }
     }
     else
     {
@@ -672,7 +2024,7 @@ void Level::init_default_level()
 
     for(v2i pos = {-10, 0}; pos.x <= 10; pos.x++)
     {
-        grid.at(pos)->filled = true;
+        grid.set_filled(pos, true);
     }
 
     strcpy(editor.loaded_level, "(empty)");
@@ -680,6 +2032,9 @@ void Level::init_default_level()
 
 void Level::uninit()
 {
+    // The file mapping, chunks and quad caches aren't owned by anything that frees itself, called on the GL thread
+    chunk_streamer.close();
+    grid.clear();
 }
 
 void Level::change_mode(Mode new_mode)
@@ -687,24 +2042,42 @@ void Level::change_mode(Mode new_mode)
     current_mode = new_mode;
 }
 
-void Level::cleanup()
+void Level::update_streaming()
 {
+    if(!chunk_streamer.is_open()) return;
+
+    chunk_streamer.areas.clear();
+    for(int i = 0; i < avatars.count(); i++)
+    {
+        v2 half_extents = v2(1.0f, 1.0f) * avatars.full_extents[i] * 0.5f;
+        chunk_streamer.areas.push_back({avatars.positions[i] - half_extents, avatars.positions[i] + half_extents});
+    }
+#if !HEADLESS
+    if(!Engine::instance->headless)
+    {
+        ChunkStreamer::Area view;
+        Graphics::Camera::view_bounds(&view.bl, &view.tr);
+        chunk_streamer.areas.push_back(view);
+    }
+#endif
+
+    chunk_streamer.update();
 }
 
 v2 Level::get_avatar_position(GameInput::UID id)
 {
-    auto it = avatars.find(id);
-    if(it == avatars.end())
+    int index = avatars.find(id);
+    if(index == -1)
     {
         return v2();
     }
     else
     {
-        return it->second->position;
+        return avatars.positions[index];
     }
 }
 
-#if DEBUG
+#if DEBUG && !HEADLESS
 void Level::draw_debug_ui()
 {
     if(ImGui::BeginTabItem("Level"))
@@ -717,74 +2090,113 @@ void Level::draw_debug_ui()
             strcpy(file_path, load_level_buff);
             load_with_file(load_level_buff, true);
         }
+
+        // Should stay flat while avatars move around, only the editor and loading add chunks
+        ImGui::Text("Grid chunks: %i", (int)grid.chunks.size());
+        ImGui::Text("Grid cells: %i", (int)grid.chunks.size() * Grid::CELLS_PER_CHUNK);
+        int num_quads = 0;
+        for(Grid::Chunk *chunk : grid.chunks)
+        {
+            num_quads += chunk->num_quads;
+        }
+        ImGui::Text("Terrain quads: %i", num_quads);
+        int num_triggers = 0;
+        for(const std::pair<const v2i, std::vector<Grid::Trigger>> &chunk_triggers : grid.triggers)
+        {
+            num_triggers += (int)chunk_triggers.second.size();
+        }
+        ImGui::Text("Trigger rectangles: %i in %i chunks", num_triggers, (int)grid.triggers.size());
+        ImGui::Checkbox("Continuous collision", &continuous_collision);
+        ImGui::Checkbox("Parallel stepping", &parallel_stepping);
+        if(chunk_streamer.is_open())
+        {
+            ImGui::Text("Streamed chunks: %i resident of %i, %i paged in, %i evicted", (int)grid.chunks.size(),
+                    (int)chunk_streamer.sources.size(), chunk_streamer.num_paged_in, chunk_streamer.num_evicted);
+        }
+        {
+            std::lock_guard<std::mutex> lock(Levels::instance->templates_mutex);
+            ImGui::Text("Cached levels: %i, %i KB", (int)Levels::instance->templates.size(), Levels::instance->templates_size / 1024);
+        }
+
+        std::vector<std::pair<int, int>> touching;
+        avatar_hash.query_pairs(0.0f, &touching);
+        ImGui::Text("Avatars: %i, touching pairs: %i", (int)avatar_hash.entries.size(), (int)touching.size());
         ImGui::EndTabItem();
     }
 }
 #endif
 
-Level::Avatar *Level::add_avatar(GameInput::UID id)
+int Level::add_avatar(GameInput::UID id)
 {
-    Avatar *new_avatar = new Avatar();
-    new_avatar->reset(this);
-    avatars[id] = new_avatar;
-
-    return new_avatar;
+    Avatar new_avatar;
+    new_avatar.reset(this);
+    return avatars.add(id, new_avatar);
 }
 
 void Level::remove_avatar(GameInput::UID id)
 {
-    avatars.erase(id);
+    int index = avatars.find(id);
+    if(index != -1)
+    {
+        avatars.remove_at(index);
+    }
 }
 
-GameInput *Level::get_input(GameInputList *inputs, GameInput::UID uid)
+void Level::remove_unseen_avatars(std::vector<uint8_t> &seen)
 {
-    for(int i = 0; i < inputs->size(); i++)
+    // Walking backwards, whatever gets swapped into a hole has already been looked at
+    for(int i = avatars.count() - 1; i >= 0; i--)
     {
-        if((*inputs)[i].uid == uid)
+        if(!seen[i])
         {
-            return &(*inputs)[i];
+            avatars.remove_at(i);
         }
     }
-
-    return nullptr;
 }
 
 void Level::playing_step(GameInputList inputs, float time_step)
 {
     // Sync and match level avatars to game inputs
-    // Each game input should map to one avatar to control
-    // TODO: This should be done differently
+    // Avatars without an input leave first, removing reorders the arrays
+    std::vector<uint8_t> seen(avatars.count(), 0);
     for(GameInput &input : inputs)
     {
-        auto it = avatars.find(input.uid);
-        if(it == avatars.end())
-        {
-            add_avatar(input.uid);
-        }
+        int index = avatars.find(input.uid);
+        if(index != -1) seen[index] = 1;
     }
-    std::vector<GameInput::UID> uids_to_remove;
-    for(const std::pair<GameInput::UID, Avatar *> &pair : avatars)
+    remove_unseen_avatars(seen);
+
+    // Each game input should map to one avatar to control, the first input wins for repeated uids
+    std::vector<int> input_of_avatar(avatars.count(), -1);
+    for(int i = 0; i < (int)inputs.size(); i++)
     {
-        auto it = std::find_if(inputs.begin(), inputs.end(), [&](const GameInput &input) { return input.uid == pair.first; });
-        if(it == inputs.end())
+        int index = avatars.find(inputs[i].uid);
+        if(index == -1)
         {
-            uids_to_remove.push_back(pair.first);
+            index = add_avatar(inputs[i].uid);
+            input_of_avatar.push_back(-1);
+        }
+        if(input_of_avatar[index] == -1)
+        {
+            input_of_avatar[index] = i;
         }
-    }
-    while(uids_to_remove.size() > 0)
-    {
-        remove_avatar(uids_to_remove.back());
-        uids_to_remove.pop_back();
     }
 
-    // Update all avatars in the level
-    for(const std::pair<GameInput::UID, Avatar *> &pair : avatars)
+    for(int index = 0; index < avatars.count(); index++)
     {
-        GameInput *input = get_input(&inputs, pair.first);
-        Avatar *avatar = pair.second;
-        avatar->step(input, this, time_step);
+        GameInput *input = &inputs[input_of_avatar[index]];
+        if(input->action(GameInput::Action::SHOOT))
+        {
+            Log::log_info("Bang!");
+        }
     }
 
+    // Update all avatars in the level, velocities in one batch then collisions in parallel
+    integrate_avatars(inputs, input_of_avatar, time_step);
+    move_avatars(time_step);
+    apply_avatar_events();
+    avatar_hash.build(avatars);
+
     // Check local input for menus
     // This is assuming that the platform input has been read at this point
     if(Platform::Input::key_down(Platform::Input::Key::ESC))
@@ -798,22 +2210,71 @@ void Level::playing_step(GameInputList inputs, float time_step)
 
 }
 
+void Level::move_avatars(float time_step)
+{
+    step_events.assign(avatars.count(), 0);
+
+    // Moving only reads the grid and writes to the avatar's own slots, so batches can run in any order
+    auto move_batch = [this, time_step](int batch_begin, int batch_end)
+    {
+        for(int index = batch_begin; index < batch_end; index++)
+        {
+            Avatar avatar = avatars.load(index);
+            step_events[index] = avatar.move_and_collide(this, time_step);
+            avatars.store(index, avatar);
+        }
+    };
+
+    // Big enough batches that a handful of avatars doesn't pay for waking up workers
+    const int AVATARS_PER_BATCH = 32;
+    if(parallel_stepping)
+    {
+        Jobs::parallel_for(0, avatars.count(), AVATARS_PER_BATCH, move_batch);
+    }
+    else
+    {
+        move_batch(0, avatars.count());
+    }
+}
+
+void Level::apply_avatar_events()
+{
+    // Same order the avatars used to change the mode in when they were stepped one by one
+    for(int index = 0; index < avatars.count(); index++)
+    {
+        if(step_events[index] & Avatar::TOUCHED_WIN)
+        {
+            change_mode(WIN);
+        }
+        if(step_events[index] & Avatar::FELL_OUT)
+        {
+            change_mode(LOSS);
+        }
+    }
+}
+
 void Level::paused_step(GameInputList inputs, float time_step)
 {
 }
 
 void Level::win_step(GameInputList inputs, float time_step)
 {
-
+    // Likely the next thing the players pick, have it ready by then
+    int next_level_num = number + 1;
+    if(Levels::instance->prefetch_next_level && next_level_num < (int)Levels::instance->level_files.size())
+    {
+        Levels::prefetch_level(next_level_num);
+    }
 }
 
 void Level::loss_step(GameInputList inputs, float time_step)
 {
 }
 
-void Level::playing_draw(GameInput::UID local_uid)
+#if !HEADLESS
+void Level::playing_draw(GameInput::UID local_uid, float step_alpha)
 {
-    general_draw(local_uid);
+    general_draw(local_uid, step_alpha);
 }
 
 static void begin_base_menu()
@@ -847,9 +2308,9 @@ static ImVec2 get_button_size()
     return button_size;
 }
 
-void Level::paused_draw(GameInput::UID local_uid)
+void Level::paused_draw(GameInput::UID local_uid, float step_alpha)
 {
-    general_draw(local_uid);
+    general_draw(local_uid, step_alpha);
 
     // Draw pause menu UI
     ImGui::Begin("Pause Window");
@@ -860,9 +2321,9 @@ void Level::paused_draw(GameInput::UID local_uid)
     ImGui::End();
 }
 
-void Level::win_draw(GameInput::UID local_uid)
+void Level::win_draw(GameInput::UID local_uid, float step_alpha)
 {
-    general_draw(local_uid);
+    general_draw(local_uid, step_alpha);
 
     begin_base_menu();
 
@@ -882,9 +2343,9 @@ void Level::win_draw(GameInput::UID local_uid)
     end_base_menu();
 }
 
-void Level::loss_draw(GameInput::UID local_uid)
+void Level::loss_draw(GameInput::UID local_uid, float step_alpha)
 {
-    general_draw(local_uid);
+    general_draw(local_uid, step_alpha);
 
     begin_base_menu();
 
@@ -899,61 +2360,65 @@ void Level::loss_draw(GameInput::UID local_uid)
     end_base_menu();
 }
 
-void Level::general_draw(GameInput::UID local_uid)
+void Level::general_draw(GameInput::UID local_uid, float step_alpha)
 {
     v2 camera_offset = v2(16.0f, 4.0f);
 
-    auto focus_avatar_it = avatars.find(local_uid);
-    if(focus_avatar_it != avatars.end())
+    int focus_index = avatars.find(local_uid);
+    if(focus_index != -1)
     {
-        Avatar *focus_avatar = focus_avatar_it->second;
-        Graphics::Camera::position() = focus_avatar->position + camera_offset;
+        Graphics::Camera::position() = avatars.interpolated_position(focus_index, step_alpha) + camera_offset;
     }
     Graphics::Camera::width() = 64.0f;
 
+    // Only things overlapping the view get submitted
+    v2 view_bl, view_tr;
+    Graphics::Camera::view_bounds(&view_bl, &view_tr);
+
     // Draw the players
-    for(const std::pair<GameInput::UID, Avatar *> &pair : avatars)
+    for(int i = 0; i < avatars.count(); i++)
     {
-        Avatar *avatar = pair.second;
-        avatar->draw();
+        v2 position = avatars.interpolated_position(i, step_alpha);
+        float full_extent = avatars.full_extents[i];
+        float half_extent = full_extent * 0.5f;
+        if(position.x + half_extent < view_bl.x || position.x - half_extent > view_tr.x) continue;
+        if(position.y + half_extent < view_bl.y || position.y - half_extent > view_tr.y) continue;
+
+        Graphics::quad(position, v2(1.0f, 1.0f) * full_extent, 0.0f, avatars.colors[i]);
     }
 
-    // Draw grid terrain
-    for(auto &pair : grid.cells_map)
+    // Draw grid terrain, culled per chunk. Chunks are only baked again after a cell in them changes
+    float chunk_world_size = Grid::CHUNK_SIZE * grid.world_scale;
+    for(Grid::Chunk *chunk : grid.chunks)
     {
-        v2i pos = v2i(pair.first.x, pair.first.y);
-        Grid::Cell *cell = pair.second;
-        if(cell->filled)
-        {
-            float inten = (float)pos.x / 100.0f;
-            v4 color = v4(1.0f - inten, 0.0f, inten, 1.0f);
-            if(pos == v2i(0, 0)) color = v4(1.0f, 1.0f, 1.0f, 1.0f);
-
-            v2 world_pos = grid.cell_to_world(pos) + v2(1.0f, 1.0f) * grid.world_scale / 2.0f;
-            float scale = grid.world_scale * 0.95f;
-            Graphics::quad(world_pos, v2(scale, scale), 0.0f, color);
-        }
+        v2 chunk_bl = grid.cell_to_world(chunk->cell_position(0));
+        v2 chunk_tr = chunk_bl + v2(1.0f, 1.0f) * chunk_world_size;
+        if(chunk_tr.x < view_bl.x || chunk_bl.x > view_tr.x) continue;
+        if(chunk_tr.y < view_bl.y || chunk_bl.y > view_tr.y) continue;
 
-        if(cell->win_when_touched)
+        if(chunk->render_dirty)
         {
-            v4 color = v4(0.0f, 1.0f, 0.0f, 1.0f);
-            v2 world_pos = grid.cell_to_world(pos) + v2(1.0f, 1.0f) * grid.world_scale / 2.0f;
-            float scale = grid.world_scale * 0.95f;
-            Graphics::quad(world_pos, v2(scale, scale), 0.0f, color);
+            grid.bake_chunk(chunk);
         }
+        Graphics::draw_quad_cache(chunk->quad_cache);
     }
 }
+#endif
 
 void Level::load_with_file(const char *path, bool reading)
 {
     if(reading)
     {
-        Serialization::Stream *stream = Serialization::make_stream_from_file(path);
-        if(stream)
+        // Only the chunks around the avatars and the camera get read, from update_streaming
+        bool loaded = chunk_streamer.open(path, this);
+        if(loaded && !stream_chunks)
         {
-            deserialize(stream);
-            Serialization::free_stream(stream);
+            chunk_streamer.page_in_all();
+            chunk_streamer.close();
+        }
 
+        if(loaded)
+        {
             const char *name = strrchr(path, '/');
             if(name != nullptr)
             {
@@ -968,10 +2433,99 @@ void Level::load_with_file(const char *path, bool reading)
     }
     else
     {
+        // Everything has to be resident to be written out, afterwards the new file is streamed from
+        bool streaming = chunk_streamer.is_open();
+        if(streaming)
+        {
+            chunk_streamer.page_in_all();
+            chunk_streamer.close();
+        }
+
         Serialization::Stream *stream = Serialization::make_stream();
-        serialize(stream);
+        write_level_file(stream);
         stream->write_to_file(path);
         Serialization::free_stream(stream);
+        Levels::uncache_level_file(path);
+
+        if(streaming)
+        {
+            chunk_streamer.open(path, this);
+        }
+    }
+}
+
+void Level::write_level_file(Serialization::Stream *stream)
+{
+    // Empty chunks don't need to be in the file, the others are encoded unless that doesn't make them smaller
+    std::vector<Grid::Chunk *> written;
+    std::vector<int> payload_sizes;
+    std::vector<char> payloads;
+    for(Grid::Chunk *chunk : grid.chunks)
+    {
+        Grid::ChunkRows rows;
+        Grid::copy_rows(chunk, &rows);
+        if(is_empty(rows)) continue;
+
+        char encoded[Grid::MAX_ENCODED_ROWS_SIZE];
+        int size = Grid::encode_rows(rows, encoded);
+        const char *payload = encoded;
+        if(size >= (int)sizeof(rows))
+        {
+            size = sizeof(rows);
+            payload = (const char *)&rows;
+        }
+
+        // Padded so the next payload starts 8 byte aligned
+        int padded_size = (size + 7) & ~7;
+        int start = (int)payloads.size();
+        payloads.resize(start + padded_size, 0);
+        Platform::Memory::memcpy(&payloads[start], payload, size);
+
+        written.push_back(chunk);
+        payload_sizes.push_back(size);
+    }
+
+    LevelFileHeader header = {};
+    header.magic = LEVEL_FILE_MAGIC;
+    header.version = LEVEL_FILE_VERSION;
+    header.world_scale = grid.world_scale;
+    header.start_x = grid.start_point.x;
+    header.start_y = grid.start_point.y;
+    header.num_avatars = avatars.count();
+    header.avatars_offset = sizeof(LevelFileHeader);
+    header.num_chunks = (int)written.size();
+    header.directory_offset = header.avatars_offset + header.num_avatars * AVATAR_RECORD_SIZE;
+    int payloads_offset = header.directory_offset + header.num_chunks * (int)sizeof(LevelFileChunk);
+    payloads_offset = (payloads_offset + 7) & ~7;
+
+    stream->write_array(sizeof(header), (char *)&header);
+
+    for(int i = 0; i < avatars.count(); i++)
+    {
+        stream->write(avatars.uids[i]);
+        stream->write(avatars.positions[i]);
+        stream->write(avatars.colors[i]);
+    }
+
+    int payload_offset = payloads_offset;
+    for(int i = 0; i < (int)written.size(); i++)
+    {
+        LevelFileChunk entry = {};
+        entry.x = written[i]->position.x;
+        entry.y = written[i]->position.y;
+        entry.payload_offset = payload_offset;
+        entry.payload_size = payload_sizes[i];
+        stream->write_array(sizeof(entry), (char *)&entry);
+        payload_offset += (payload_sizes[i] + 7) & ~7;
+    }
+
+    while(stream->size() < payloads_offset)
+    {
+        stream->write((char)0);
+    }
+    if(!payloads.empty())
+    {
+        stream->write_array((int)payloads.size(), payloads.data());
     }
 }
 
@@ -993,7 +2547,7 @@ Level *Levels::create_level(int level_num)
 
 void Levels::destroy_level(Level *level)
 {
-    level->cleanup();
+    level->uninit();
     delete level;
 }
 
@@ -1002,12 +2556,183 @@ Level *Levels::active_level()
     return instance->active_level;
 }
 
-Level *Levels::start_level(int level_number)
+// The level of a load nobody is going to start anymore
+static void drop_load(LevelLoad *load)
 {
-    instance->active_level->uninit();
-    delete instance->active_level;
+    Jobs::wait(&load->counter);
+    Levels::destroy_level(load->level);
+    delete load;
+}
 
-    instance->active_level = new Level();
-    instance->active_level->init(level_number);
-    return instance->active_level;
+void Levels::start_level(int level_number)
+{
+    instance->wanted_level = level_number;
+    prefetch_level(level_number);
+}
+
+void Levels::prefetch_level(int level_number)
+{
+    if(instance->loads.find(level_number) != instance->loads.end()) return;
+
+    LevelLoad *load = new LevelLoad();
+    instance->loads[level_number] = load;
+    Jobs::run_in_background([load, level_number]()
+    {
+        load->level = create_level(level_number);
+    }, &load->counter);
+}
+
+bool Levels::swap_in_loaded_level()
+{
+    if(instance->wanted_level == -1) return false;
+
+    std::map<int, LevelLoad *>::iterator it = instance->loads.find(instance->wanted_level);
+    LevelLoad *load = it->second;
+    if(Jobs::num_workers() == 1 || Engine::instance->fast_forwarding)
+    {
+        // Nobody else is going to load it, or fast forwarding would run steps without the level
+        Jobs::wait(&load->counter);
+    }
+    if(!Jobs::is_done(&load->counter)) return false;
+
+    destroy_level(instance->active_level);
+    instance->active_level = load->level;
+
+    delete load;
+    instance->loads.erase(it);
+    instance->wanted_level = -1;
+
+    // Prefetches the player went past, e.g. the next level when they went back to the menu instead
+    for(it = instance->loads.begin(); it != instance->loads.end();)
+    {
+        if(!Jobs::is_done(&it->second->counter))
+        {
+            ++it;
+            continue;
+        }
+        drop_load(it->second);
+        it = instance->loads.erase(it);
+    }
+    return true;
+}
+
+bool Levels::loading_level()
+{
+    return instance->wanted_level != -1;
+}
+
+bool Levels::instantiate_cached_level(int level_number, Level *level)
+{
+    std::lock_guard<std::mutex> lock(instance->templates_mutex);
+
+    std::map<int, LevelTemplate *>::iterator it = instance->templates.find(level_number);
+    if(it == instance->templates.end()) return false;
+    LevelTemplate *cached = it->second;
+    cached->last_used = ++instance->num_template_uses;
+
+    level->grid.world_scale = cached->world_scale;
+    level->grid.start_point = cached->start_point;
+    level->avatars = cached->avatars;
+    strcpy(level->editor.loaded_level, cached->loaded_level);
+
+    level->grid.chunks.reserve(cached->chunks.size());
+    for(const Level::Grid::Chunk &source : cached->chunks)
+    {
+        Level::Grid::Chunk *chunk = new Level::Grid::Chunk(source);
+        level->grid.chunks.push_back(chunk);
+        level->grid.chunks_map[chunk->position] = chunk;
+    }
+    level->grid.triggers = cached->triggers;
+    return true;
+}
+
+void Levels::cache_level(int level_number, Level *level)
+{
+    if(!instance->cache_levels) return;
+
+    // Copied outside the lock, other loads only wait on the cache for the copies out of it
+    LevelTemplate *cached = new LevelTemplate();
+    cached->world_scale = level->grid.world_scale;
+    cached->start_point = level->grid.start_point;
+    cached->avatars = level->avatars;
+    strcpy(cached->loaded_level, level->editor.loaded_level);
+    cached->chunks.reserve(level->grid.chunks.size());
+    for(const Level::Grid::Chunk *chunk : level->grid.chunks)
+    {
+        cached->chunks.push_back(*chunk);
+        cached->chunks.back().quad_cache = nullptr;
+        cached->chunks.back().num_quads = 0;
+        cached->chunks.back().render_dirty = true;
+    }
+    cached->triggers = level->grid.triggers;
+    cached->size = (int)sizeof(LevelTemplate) + (int)cached->chunks.size() * (int)sizeof(Level::Grid::Chunk) +
+        level->avatars.count() * AVATAR_RECORD_SIZE;
+
+    if(cached->size > instance->templates_budget)
+    {
+        delete cached;
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(instance->templates_mutex);
+
+    // Two loads of the same level can race here, the file is the same so either copy does
+    std::map<int, LevelTemplate *>::iterator it = instance->templates.find(level_number);
+    if(it != instance->templates.end())
+    {
+        delete cached;
+        return;
+    }
+    cached->last_used = ++instance->num_template_uses;
+    instance->templates[level_number] = cached;
+    instance->templates_size += cached->size;
+
+    while(instance->templates_size > instance->templates_budget)
+    {
+        std::map<int, LevelTemplate *>::iterator oldest = instance->templates.begin();
+        for(it = instance->templates.begin(); it != instance->templates.end(); it++)
+        {
+            if(it->second->last_used < oldest->second->last_used) oldest = it;
+        }
+
+        instance->templates_size -= oldest->second->size;
+        delete oldest->second;
+        instance->templates.erase(oldest);
+    }
+}
+
+void Levels::uncache_level_file(const char *path)
+{
+    // Loads of the file read it before it was written, and would cache what they read once they're done
+    bool reload_wanted_level = false;
+    for(const std::pair<const int, char *> &file : instance->level_files)
+    {
+        if(strcmp(file.second, path) != 0) continue;
+
+        std::map<int, LevelLoad *>::iterator load = instance->loads.find(file.first);
+        if(load == instance->loads.end()) continue;
+        drop_load(load->second);
+        instance->loads.erase(load);
+        reload_wanted_level |= instance->wanted_level == file.first;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(instance->templates_mutex);
+
+        for(const std::pair<const int, char *> &file : instance->level_files)
+        {
+            if(strcmp(file.second, path) != 0) continue;
+
+            std::map<int, LevelTemplate *>::iterator it = instance->templates.find(file.first);
+            if(it == instance->templates.end()) continue;
+            instance->templates_size -= it->second->size;
+            delete it->second;
+            instance->templates.erase(it);
+        }
+    }
+
+    if(reload_wanted_level)
+    {
+        prefetch_level(instance->wanted_level);
+    }
 }
@@ -3,9 +3,13 @@
 
 #include "game.h"
 #include "game_math.h"
+#include "platform.h"
 #include "serialization.h"
 
+#include <stdint.h>
 #include <map>
+#include <vector>
+#include <unordered_map>
 
 
 
@@ -18,7 +22,22 @@ struct Levels
     static void destroy_level(Level *level);
 
     static Level *active_level();
-    static Level *start_level(int level_number);
+    // Loads the level on the job system, it becomes the active level at the start of the first step after it's done
+    static void start_level(int level_number);
+    // Starts loading a level that will likely be started soon, start_level picks it up from there
+    static void prefetch_level(int level_number);
+    // Called between steps, true if the level start_level asked for just became the active level.
+    // Waits for the load while fast forwarding, otherwise it keeps the old level until the load is done.
+    static bool swap_in_loaded_level();
+    // True from start_level until its level is the active one
+    static bool loading_level();
+
+    // Levels read all the way from their files are kept as templates, least recently used ones go once
+    // the cache is over its budget. Safe to call from jobs. False if the level isn't cached.
+    static bool instantiate_cached_level(int level_number, Level *level);
+    static void cache_level(int level_number, Level *level);
+    // After the file was written, the next start reads it again. Drops loads of the file, a started one starts over.
+    static void uncache_level_file(const char *path);
 };
 
 
@@ -36,11 +55,21 @@ public:
         v2i() {}
         v2i(int a, int b) : x(a), y(b) {}
 
-        v2i operator+(v2i b) { return v2i(x + b.x, y + b.y); }
-        v2i operator-(v2i b) { return v2i(x - b.x, y - b.y); }
-        bool operator==(v2i b) { return (this->x == b.x) && (this->y == b.y); }
+        v2i operator+(v2i b) const { return v2i(x + b.x, y + b.y); }
+        v2i operator-(v2i b) const { return v2i(x - b.x, y - b.y); }
+        bool operator==(v2i b) const { return (this->x == b.x) && (this->y == b.y); }
     };
 
+    struct v2iHash
+    {
+        size_t operator()(const v2i &a) const
+        {
+            return ((size_t)(unsigned int)a.x * 73856093u) ^ ((size_t)(unsigned int)a.y * 19349663u);
+        }
+    };
+
+    struct ChunkStreamer;
+
     struct Grid
     {
         struct Cell
@@ -51,31 +80,113 @@ public:
             void reset();
         };
 
-        struct v2iComp
+        // Cells are stored in dense square chunks, row by row. A chunk row is
+        // exactly one 64 bit word in the bitboards.
+        static const int CHUNK_SIZE_BITS = 6;
+        static const int CHUNK_SIZE = 1 << CHUNK_SIZE_BITS;
+        static const int CELLS_PER_CHUNK = CHUNK_SIZE * CHUNK_SIZE;
+        struct Rect
+        {
+            v2i position; // Bottom left cell
+            v2i size;     // In cells
+            GameMath::v4 color;
+        };
+        struct Chunk
         {
-            bool operator()(const v2i &a, const v2i &b) const
+            v2i position; // In chunks, not cells
+            Cell cells[CELLS_PER_CHUNK];
+
+            // Bitboards kept in sync with cells, bit x of word y is the cell at (x, y) in the chunk
+            uint64_t filled_rows[CHUNK_SIZE];
+            uint64_t win_rows[CHUNK_SIZE];
+
+            // Maximal same coloured rectangles of the filled and win cells, baked into retained quads
+            struct QuadCache *quad_cache;
+            int num_quads;
+            bool render_dirty; // Set when a cell changes, the quads get baked again before the next draw
+            bool edited;       // Changed through the setters, the level file doesn't have these cells so it can't be evicted
+
+            v2i cell_position(int index) const;
+        };
+
+        struct ChunkRows
+        {
+            uint64_t filled[CHUNK_SIZE];
+            uint64_t win[CHUNK_SIZE];
+        };
+        // Every word of the rows costs at most a control byte and itself encoded
+        static const int MAX_ENCODED_ROWS_SIZE = 2 * CHUNK_SIZE * (1 + sizeof(uint64_t));
+
+        enum RowFlag
+        {
+            FILLED,
+            WIN_WHEN_TOUCHED,
+        };
+
+        // Cells that do something when an avatar touches them, merged into rectangles per chunk
+        struct Trigger
+        {
+            enum Type : uint8_t
             {
-                if(a.x == b.x) return a.y < b.y;
-                else return a.x < b.x;
-            }
+                WIN = 1 << 0,
+            };
+
+            v2i position; // Bottom left cell
+            v2i size;     // In cells
+            uint8_t types;
         };
 
         // How big is a grid cell in world space?
         float world_scale;
-        std::map<v2i, Cell *, v2iComp> cells_map;
+        // Chunks in the order they were allocated, iterate these for memory order
+        std::vector<Chunk *> chunks;
+        std::unordered_map<v2i, Chunk *, v2iHash> chunks_map;
         v2i start_point;
+        // Set while the grid is streamed from a level file, chunks are read from it when they get added
+        ChunkStreamer *streamer = nullptr;
+        // Only chunks with trigger cells have an entry, rebuilt whenever the cells of a chunk change
+        std::unordered_map<v2i, std::vector<Trigger>, v2iHash> triggers;
 
         void init();
         void clear();
-        Cell *at(Level::v2i pos);
-        GameMath::v2 cell_to_world(v2i pos);
-        v2i world_to_cell(GameMath::v2 pos);
+        // Read-only queries, these never allocate and return nullptr/false outside of stored chunks
+        const Cell *find(v2i pos) const;
+        const Chunk *find_chunk(v2i chunk_pos) const;
+        bool is_filled(v2i pos) const;
+        // Bit i is set if the cell at start + (i, 0) has the flag, count is at most 64
+        uint64_t row_bits(v2i start, int count, RowFlag flag) const;
+        // Trigger::Type flags of all triggers the box touches
+        uint8_t touched_triggers(GameMath::v2 bl, GameMath::v2 tr) const;
+        // For the editor and loading, allocates the chunk holding the cell if it doesn't exist yet
+        void set_filled(v2i pos, bool filled);
+        void set_win_when_touched(v2i pos, bool win_when_touched);
+        Chunk *get_or_add_chunk(v2i chunk_pos);
+        void remove_chunk(Chunk *chunk);
+        // Overwrites every cell of the chunk, only marks it dirty if something changed
+        void replace_rows(Chunk *chunk, const ChunkRows &rows);
+        void rebuild_triggers(const Chunk *chunk);
+        static v2i cell_to_chunk(v2i pos);
+        static int cell_index_in_chunk(v2i pos);
+        GameMath::v2 cell_to_world(v2i pos) const;
+        v2i world_to_cell(GameMath::v2 pos) const;
         void serialize(Serialization::Stream *stream, bool writing = true);
+        // Reads num_cells cell records of a version 1 level file, sorted into the chunks they belong to
+        static void read_cells(Serialization::Stream *stream, int num_cells, std::unordered_map<v2i, ChunkRows, v2iHash> *incoming);
+        // Run length encoding of the bitboards for level files and the network, out needs
+        // MAX_ENCODED_ROWS_SIZE bytes. Decoding returns false if the data is broken.
+        static int encode_rows(const ChunkRows &rows, char *out);
+        static bool decode_rows(const char *in, int size, ChunkRows *rows);
+        static void copy_rows(const Chunk *chunk, ChunkRows *rows);
+#if !HEADLESS
+        void bake_chunk(Chunk *chunk);
+#endif
     };
 
+    // One avatar's state, avatars are stored in AvatarArrays and loaded into this to step them
     struct Avatar
     {
         GameMath::v2 position;
+        GameMath::v2 previous_position; // Position as of the last step, for interpolated drawing
         GameMath::v4 color;
         bool grounded;
         float horizontal_velocity;
@@ -86,12 +197,141 @@ public:
         float gravity;
         float full_extent;
 
+        // What an avatar ran into while moving. Avatars move in parallel and only read the
+        // level, so these get applied to it afterwards in avatar order.
+        enum Event : uint8_t
+        {
+            TOUCHED_WIN = 1 << 0,
+            FELL_OUT    = 1 << 1,
+        };
+
         void reset(Level *level);
-        void step(GameInput *input, Level *level, float time_step);
-        void draw();
+        // Input, friction and gravity into velocity. Level::integrate_avatars is the batched version of this
+        void integrate(GameInput *input, float time_step);
+        // Returns the Event flags of this step
+        uint8_t move_and_collide(Level *level, float time_step);
+        // Moves by move, stopping at the first tile face hit and sliding along it
+        void sweep(Level *level, GameMath::v2 move);
+        bool time_of_impact(Level *level, GameMath::v2 move, float *time, GameMath::v2 *normal);
         void check_and_resolve_collisions(Level *level);
     };
 
+    // All avatars of a level as parallel arrays, index i of every array is the same avatar.
+    // Removing swaps the last avatar into the hole, so indices are only stable until the next remove.
+    struct AvatarArrays
+    {
+        std::vector<GameInput::UID> uids;
+        std::vector<GameMath::v2> positions;
+        std::vector<GameMath::v2> previous_positions;
+        std::vector<GameMath::v4> colors;
+        std::vector<uint8_t> grounded;
+        std::vector<float> horizontal_velocities;
+        std::vector<float> vertical_velocities;
+        std::vector<float> run_strengths;
+        std::vector<float> friction_strengths;
+        std::vector<float> masses;
+        std::vector<float> gravities;
+        std::vector<float> full_extents;
+        std::unordered_map<GameInput::UID, int> index_of_uid;
+
+        int count();
+        int find(GameInput::UID uid); // -1 if there's no avatar for uid
+        int add(GameInput::UID uid, const Avatar &avatar);
+        void remove_at(int index);
+        void clear();
+        Avatar load(int index);
+        void store(int index, const Avatar &avatar);
+#if !HEADLESS
+        GameMath::v2 interpolated_position(int index, float step_alpha);
+#endif
+    };
+
+    // Uniform grid broadphase over the avatars, rebuilt every playing step.
+    // Each avatar is bucketed by the cell its center is in, queries look one
+    // cell (plus the largest avatar) further out so nothing is missed.
+    struct AvatarHash
+    {
+        struct Entry
+        {
+            GameMath::v2 position;
+            float half_extent;
+            v2i cell;
+            int next; // Next entry in the same bucket, -1 at the end
+        };
+
+        float cell_size = 2.0f;
+        float max_half_extent = 0.0f;
+        std::vector<Entry> entries;  // Entry i is avatar index i, so queries are deterministic
+        std::vector<int> buckets;    // First entry of each bucket, -1 when empty
+
+        void clear();
+        void build(AvatarArrays &avatars);
+        // Indices of the avatars whose boxes overlap the given box
+        void query_range(GameMath::v2 bl, GameMath::v2 tr, std::vector<int> *results);
+        // Index pairs of avatars whose boxes are within margin of each other, each pair reported once
+        void query_pairs(float margin, std::vector<std::pair<int, int>> *pairs);
+
+    private:
+        std::vector<int> found; // Scratch for gather, kept around to avoid allocating every query
+
+        v2i world_to_cell(GameMath::v2 pos);
+        int bucket_of(v2i cell);
+        // Fills found with the entries overlapping the box, in entry order
+        void gather(GameMath::v2 bl, GameMath::v2 tr);
+    };
+
+    // Keeps only the chunks of a level file around the avatars and the camera in memory. The file
+    // is mapped, chunks are copied or decoded out of it when something comes close and evicted least
+    // recently needed first once the resident chunks go over the memory budget. Version 2 and up have
+    // a chunk directory, version 1 files are scanned once on open for where each chunk's cells are.
+    struct ChunkStreamer
+    {
+        struct Run // Consecutive cell records of a version 1 file that all belong to one chunk
+        {
+            int offset;
+            int num_cells;
+        };
+        struct Source
+        {
+            const char *payload;   // Version 2 and up, raw or encoded rows straight from the mapped file
+            int payload_size;
+            std::vector<Run> runs; // Version 1
+            int last_needed;       // Update this chunk was last close to an area
+        };
+        struct Area
+        {
+            GameMath::v2 bl;
+            GameMath::v2 tr;
+        };
+
+        int radius = 1;                       // In chunks, around every area
+        int memory_budget = 32 * 1024 * 1024; // For resident chunks, chunks close to an area stay even when over it
+        std::vector<Area> areas;              // What to keep resident, filled before every update
+        std::unordered_map<v2i, Source, v2iHash> sources;
+        int num_updates = 0;
+        int num_paged_in = 0;
+        int num_evicted = 0;
+
+        // Empties the grid and loads the avatars and grid header of the file, the cells are read by update
+        bool open(const char *path, Level *level);
+        void close();
+        bool is_open();
+        void update();
+        void page_in_all();
+        // Fills a chunk that was just added to the grid with its cells from the file
+        void read_chunk(Grid::Chunk *chunk);
+
+    private:
+        const char *data = nullptr; // The mapped file
+        int data_size = 0;
+        Grid *grid = nullptr;
+        std::vector<std::pair<int, Grid::Chunk *>> evictable; // Scratch for update, last needed and chunk
+
+        bool open_version_1(const char *path, Level *level);
+        bool open_with_directory(const char *path, Level *level);
+        Serialization::Stream *read_range(int offset, int bytes);
+    };
+
     struct Editor
     {
         GameMath::v2 camera_position = GameMath::v2();
@@ -112,9 +352,11 @@ public:
             bool modes[3];
         };
 
+#if !HEADLESS
         void step(Level *level, float time_step);
         void draw(Level *level);
         void draw_file_menu(Level *level);
+#endif
     };
 
     enum Mode
@@ -127,7 +369,12 @@ public:
 
     int number;
     Grid grid;
-    std::map<GameInput::UID, Avatar *> avatars;
+    AvatarArrays avatars;
+    AvatarHash avatar_hash;
+    bool continuous_collision = true; // Sweep fast avatars against the grid so they can't tunnel through thin walls
+    bool parallel_stepping = true;    // Move avatars on the job system, the result is the same either way
+    bool stream_chunks = true;        // Page level file chunks in and out instead of reading the whole file
+    ChunkStreamer chunk_streamer;
     Mode current_mode;
     Editor editor;
 
@@ -136,36 +383,54 @@ public:
     void init_default_level();
     void uninit();
     void step(GameInputList inputs, float time_step);
-    void draw(GameInput::UID local_uid);
+#if !HEADLESS
+    void draw(GameInput::UID local_uid, float step_alpha);
+#endif
     void serialize(Serialization::Stream *stream);
     void deserialize(Serialization::Stream *stream);
     void change_mode(Mode new_mode);
-    void cleanup();
 
     GameMath::v2 get_avatar_position(GameInput::UID id);
+    // Pages in the chunks around the avatars and the camera, done before anything looks at the grid
+    void update_streaming();
+    // Reads the level file at path, or writes this level to it
+    void load_with_file(const char *path, bool reading);
 
-#if DEBUG
+#if DEBUG && !HEADLESS
     void draw_debug_ui();
 #endif
 
 
 private:
-    Avatar *Level::add_avatar(GameInput::UID id);
+    int add_avatar(GameInput::UID id);
     void remove_avatar(GameInput::UID id);
-    GameInput *get_input(GameInputList *inputs, GameInput::UID uid);
+    void remove_unseen_avatars(std::vector<uint8_t> &seen);
+    void deserialize_avatars(Serialization::Stream *stream);
+    void integrate_avatars(GameInputList &inputs, std::vector<int> &input_of_avatar, float time_step);
+    void move_avatars(float time_step);
+    void apply_avatar_events();
+
+    // Per avatar input lanes for integrate_avatars, kept around to avoid allocating every step
+    std::vector<float> step_movements;
+    std::vector<uint8_t> step_jumps;
+    // Avatar::Event flags of every avatar from move_avatars
+    std::vector<uint8_t> step_events;
 
     void playing_step(GameInputList inputs, float time_step);
     void paused_step(GameInputList inputs, float time_step);
     void win_step(GameInputList inputs, float time_step);
     void loss_step(GameInputList inputs, float time_step);
 
-    void playing_draw(GameInput::UID local_uid);
-    void paused_draw(GameInput::UID local_uid);
-    void win_draw(GameInput::UID local_uid);
-    void loss_draw(GameInput::UID local_uid);
-    void general_draw(GameInput::UID local_uid);
+#if !HEADLESS
+    void playing_draw(GameInput::UID local_uid, float step_alpha);
+    void paused_draw(GameInput::UID local_uid, float step_alpha);
+    void win_draw(GameInput::UID local_uid, float step_alpha);
+    void loss_draw(GameInput::UID local_uid, float step_alpha);
+    void general_draw(GameInput::UID local_uid, float step_alpha);
+#endif
 
-    void load_with_file(const char *path, bool reading);
+    // Level files are version 3, Level::serialize is what goes over the network
+    void write_level_file(Serialization::Stream *stream);
 };
 
 
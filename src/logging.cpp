@@ -32,7 +32,7 @@ static void log_message(LogState *instance, char *text, LogState::Level level)
 {
     if(instance->output_file == NULL) return;
 
-    fprintf(instance->output_file, text);
+    fputs(text, instance->output_file);
     fflush(instance->output_file);
 
     v3 color = v3(1.0f, 1.0f, 1.0f);
@@ -63,8 +63,13 @@ void Log::log_info_fn(const char *file, int line, const char *format, ...)
     const char *format1 = "-- INFO : %s : %i\n";
     const char *format2 = format;
 
+    // The argument list is walked twice, once for measuring
+    va_list measure_args;
+    va_copy(measure_args, args);
+
     int format1_size = snprintf(nullptr, 0, format1, file, line);
-    int format2_size = vsnprintf(nullptr, 0, format2, args) + 1;
+    int format2_size = vsnprintf(nullptr, 0, format2, measure_args) + 1;
+    va_end(measure_args);
 
     char *text_memory = new char[format1_size + format2_size + 1]();
 
@@ -88,8 +93,13 @@ void Log::log_warning_fn(const char *file, int line, const char *format, ...)
     const char *format1 = "-- WARNING : %s : %i\n";
     const char *format2 = format;
 
+    // The argument list is walked twice, once for measuring
+    va_list measure_args;
+    va_copy(measure_args, args);
+
     int format1_size = snprintf(nullptr, 0, format1, file, line);
-    int format2_size = vsnprintf(nullptr, 0, format2, args) + 1;
+    int format2_size = vsnprintf(nullptr, 0, format2, measure_args) + 1;
+    va_end(measure_args);
 
     char *text_memory = new char[format1_size + format2_size + 1]();
 
@@ -113,8 +123,13 @@ void Log::log_error_fn(const char *file, int line, const char *format, ...)
     const char *format1 = "-- ERROR : %s : %i\n";
     const char *format2 = format;
 
+    // The argument list is walked twice, once for measuring
+    va_list measure_args;
+    va_copy(measure_args, args);
+
     int format1_size = snprintf(nullptr, 0, format1, file, line);
-    int format2_size = vsnprintf(nullptr, 0, format2, args) + 1;
+    int format2_size = vsnprintf(nullptr, 0, format2, measure_args) + 1;
+    va_end(measure_args);
 
     char *text_memory = new char[format1_size + format2_size + 1]();
 
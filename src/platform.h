@@ -8,9 +8,12 @@ struct Platform
     static struct PlatformState *instance;
 
     static void init();
+    static void shutdown();
     static void handle_os_events();
     static bool want_to_close();
     static double time_since_start();
+    // Gives the CPU back for roughly this long, may wake up late
+    static void sleep(double seconds);
 
     // Window application
     struct Window
@@ -30,6 +33,7 @@ struct Platform
         //static void free(void *data);
         static void memset(void *buffer, int value, int bytes);
         static void memcpy(void *dest, const void *src, int bytes);
+        static int memcmp(const void *a, const void *b, int bytes);
     };
 
     // File managment
@@ -48,6 +52,9 @@ struct Platform
         static void read(File *file, void *buffer, int bytes);
         static void write(File *file, void *buffer, int bytes);
         static int size(File *file);
+        // Maps a whole file read-only, pages are only read when touched. nullptr if it can't be opened or is empty
+        static const char *map(const char *path, int *size);
+        static void unmap(const char *data, int size);
         static char *read_file_into_string(const char *path);
     };
 
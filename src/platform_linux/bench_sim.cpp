@@ -0,0 +1,115 @@
+
+#include "benchmarks.h"
+#include "game_console.h"
+#include "jobs.h"
+#include "levels.h"
+#include "logging.h"
+#include "platform.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+
+
+// Every allocation of the process goes through here so the benchmark can count them
+void *operator new(size_t size)
+{
+    Benchmarks::num_allocations++;
+    Benchmarks::allocated_bytes += size;
+    void *memory = malloc(size ? size : 1);
+    if(memory == nullptr) throw std::bad_alloc();
+    return memory;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t size) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory, size_t size) noexcept
+{
+    free(memory);
+}
+
+
+
+static void print_usage()
+{
+    printf("Usage: bench_sim [--level N | --level-file PATH] [--avatars N] [--ticks N] [--seed N]\n"
+           "                 [--inputs random|walkers] [--threads N]\n");
+}
+
+int main(int argc, char **argv)
+{
+    Benchmarks::SimulationSettings settings;
+    int num_threads = 0;
+    for(int i = 1; i < argc; i++)
+    {
+        bool has_value = i + 1 < argc;
+        if(strcmp(argv[i], "--level") == 0 && has_value)
+        {
+            settings.level_number = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--level-file") == 0 && has_value)
+        {
+            settings.level_path = argv[++i];
+        }
+        else if(strcmp(argv[i], "--avatars") == 0 && has_value)
+        {
+            settings.num_avatars = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--ticks") == 0 && has_value)
+        {
+            settings.num_ticks = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--seed") == 0 && has_value)
+        {
+            settings.seed = (uint32_t)strtoul(argv[++i], nullptr, 10);
+        }
+        else if(strcmp(argv[i], "--inputs") == 0 && has_value)
+        {
+            i++;
+            settings.inputs = (strcmp(argv[i], "random") == 0) ? Benchmarks::SimulationSettings::RANDOM : Benchmarks::SimulationSettings::WALKERS;
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && has_value)
+        {
+            num_threads = atoi(argv[++i]);
+        }
+        else
+        {
+            print_usage();
+            return 1;
+        }
+    }
+
+    // No Engine, no window and no network, only what a level needs to step
+    Platform::init();
+    Log::init();
+    GameConsole::init();
+    Jobs::init(num_threads);
+    Levels::init();
+
+    Benchmarks::counting_allocations = true;
+    Benchmarks::simulation(settings);
+
+    Jobs::shutdown();
+    Platform::shutdown();
+    return 0;
+}
@@ -0,0 +1,190 @@
+
+#include "graphics.h"
+#include "logging.h"
+#include "platform.h"
+#include "game_math.h"
+
+#include "imgui.h"
+
+
+
+using namespace GameMath;
+
+
+
+// There is no window or GL context on Linux yet. Drawing calls are accepted
+// and dropped so the game (and dedicated servers) run unchanged, and ImGui
+// still gets a context so menus and debug UI can be built every frame.
+
+struct CameraState
+{
+    v2 position = v2();
+    float width = 10.0f;
+};
+
+struct GraphicsState
+{
+    float screen_aspect_ratio;
+    double last_frame_time;
+};
+GraphicsState *Graphics::instance = nullptr;
+CameraState *Graphics::Camera::instance = nullptr;
+
+
+
+
+void Graphics::quad(v2 position, v2 scale, float rotation, v4 color, int layer)
+{
+}
+
+struct QuadCache
+{
+    int num_quads;
+};
+
+QuadCache *Graphics::make_quad_cache()
+{
+    QuadCache *cache = new QuadCache();
+    cache->num_quads = 0;
+    return cache;
+}
+
+void Graphics::free_quad_cache(QuadCache *cache)
+{
+    delete cache;
+}
+
+void Graphics::clear_quad_cache(QuadCache *cache)
+{
+    cache->num_quads = 0;
+}
+
+void Graphics::cache_quad(QuadCache *cache, v2 position, v2 scale, float rotation, v4 color)
+{
+    cache->num_quads++;
+}
+
+void Graphics::draw_quad_cache(QuadCache *cache, int layer)
+{
+}
+
+
+
+
+
+
+void Graphics::init()
+{
+    instance = new GraphicsState();
+
+    Graphics::ImGuiImplementation::init();
+
+    Camera::instance = new CameraState();
+    instance->screen_aspect_ratio = Platform::Window::aspect_ratio();
+    instance->last_frame_time = Platform::time_since_start();
+}
+
+void Graphics::clear_frame(v4 color)
+{
+}
+
+void Graphics::render()
+{
+}
+
+void Graphics::swap_frames()
+{
+}
+
+
+
+GameMath::mat4 Graphics::view_m_world()
+{
+    return make_translation_matrix(v3(-Camera::instance->position, 0.0f));
+}
+
+GameMath::mat4 Graphics::world_m_view()
+{
+    return inverse(view_m_world());
+}
+
+GameMath::mat4 Graphics::ndc_m_world()
+{
+    mat4 ndc_m_view =
+    {
+        2.0f / Camera::width(), 0.0f, 0.0f, 0.0f,
+        0.0f, (2.0f / Camera::width()) * instance->screen_aspect_ratio, 0.0f, 0.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+        0.0f, 0.0f, 0.0f, 1.0f
+    };
+
+    return ndc_m_view * view_m_world();
+}
+
+GameMath::mat4 Graphics::world_m_ndc()
+{
+    return inverse(ndc_m_world());
+}
+
+
+
+GameMath::v2 &Graphics::Camera::position()
+{
+    return instance->position;
+}
+
+float &Graphics::Camera::width()
+{
+    return instance->width;
+}
+
+void Graphics::Camera::view_bounds(v2 *bl, v2 *tr)
+{
+    // Matches ndc_m_world, the height is the width over the aspect ratio
+    v2 half_extents = v2(instance->width, instance->width / Graphics::instance->screen_aspect_ratio) * 0.5f;
+    *bl = instance->position - half_extents;
+    *tr = instance->position + half_extents;
+}
+
+
+
+
+
+
+// ImGui Implementation
+void Graphics::ImGuiImplementation::init()
+{
+    IMGUI_CHECKVERSION();
+    ImGui::CreateContext();
+    ImGuiIO& io = ImGui::GetIO();
+
+    ImGui::StyleColorsDark();
+
+    // No renderer to upload to, but ImGui wants a built font atlas before the first frame
+    unsigned char *pixels;
+    int width, height;
+    io.Fonts->GetTexDataAsAlpha8(&pixels, &width, &height);
+    io.IniFilename = nullptr;
+}
+
+void Graphics::ImGuiImplementation::new_frame()
+{
+    ImGuiIO& io = ImGui::GetIO();
+    io.DisplaySize = ImVec2((float)Platform::Window::screen_width(), (float)Platform::Window::screen_height());
+
+    double this_frame_time = Platform::time_since_start();
+    io.DeltaTime = max((float)(this_frame_time - instance->last_frame_time), 0.0001f);
+    instance->last_frame_time = this_frame_time;
+
+    ImGui::NewFrame();
+}
+
+void Graphics::ImGuiImplementation::end_frame()
+{
+    ImGui::Render();
+}
+
+void Graphics::ImGuiImplementation::shutdown()
+{
+    ImGui::DestroyContext();
+}
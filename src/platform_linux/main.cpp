@@ -0,0 +1,8 @@
+
+#include "game.h"
+
+int main(int argc, char **argv)
+{
+    Engine::start(argc, argv);
+    return 0;
+}
@@ -0,0 +1,539 @@
+
+#include "network.h"
+#include "logging.h"
+#include "platform.h"
+#include "data_structures.h"
+
+#include <vector>
+#include <cassert>
+#include <cstring>
+#include <cstdlib>
+#include <sys/types.h>
+#include <sys/socket.h> // Networking API
+#include <netinet/in.h>
+#include <arpa/inet.h> // inet_pton
+#include <netdb.h> // getnameinfo
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#define CODE_WOULD_BLOCK EWOULDBLOCK
+#define CODE_IN_PROGRESS EINPROGRESS
+#define CODE_IS_CONNECTED EISCONN
+#define CODE_INVALID EINVAL
+#define CODE_ALREADY EALREADY
+#define CODE_ISCONN EISCONN
+
+typedef int SOCKET;
+static const SOCKET INVALID_SOCKET = -1;
+static const int SOCKET_ERROR = -1;
+
+enum BlockingMode
+{
+    BLOCKING,
+    NONBLOCKING
+};
+
+struct NetworkState
+{
+    SOCKET listening_socket;
+};
+NetworkState *Network::instance = nullptr;
+
+static int get_last_error()
+{
+    return errno;
+}
+
+static bool read_bytes_from_socket(SOCKET socket, char *buffer, int max_bytes_to_read, int *bytes_actually_read)
+{
+    // Listen for a response
+    long int bytes_read_from_socket = recv(socket, buffer, max_bytes_to_read, 0);
+
+    *bytes_actually_read = (int)bytes_read_from_socket;
+
+    // Check if bytes were read
+    if(*bytes_actually_read == -1)
+    {
+        // Bytes weren't read, make sure there's an expected error code
+        if(get_last_error() != CODE_WOULD_BLOCK)
+        {
+            Log::log_error("Error receiving data: %i\n", get_last_error());
+        }
+        return false;
+    }
+    else
+    {
+        // Bytes were read
+        return true;
+    }
+}
+
+static void set_blocking_mode(SOCKET socket, BlockingMode mode)
+{
+    int flags = fcntl(socket, F_GETFL, 0);
+    if(flags == SOCKET_ERROR)
+    {
+        Log::log_error("Could not read socket flags");
+        return;
+    }
+
+    flags = (mode == BLOCKING) ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+    int error = fcntl(socket, F_SETFL, flags);
+    if(error == SOCKET_ERROR)
+    {
+        Log::log_error("Could not change socket blocking mode");
+        return;
+    }
+}
+
+static void close_socket(SOCKET socket)
+{
+    close(socket);
+}
+
+
+
+
+
+
+void Network::init()
+{
+    instance = new NetworkState();
+
+    instance->listening_socket = INVALID_SOCKET;
+}
+
+
+Network::Connection *Network::connect(const char *ip_address, int port)
+{
+    SOCKET new_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(new_socket == INVALID_SOCKET)
+    {
+        Log::log_error("Error opening socket: %i\n", get_last_error());
+        return nullptr;
+    }
+
+    set_blocking_mode(new_socket, NONBLOCKING);
+
+    // Create address
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    int error = inet_pton(AF_INET, ip_address, &address.sin_addr.s_addr);
+    if(error != 1)
+    {
+        Log::log_error("Error creating an address: %i\n", error);
+        close_socket(new_socket);
+        return nullptr;
+    }
+
+    // Try to connect
+    int code = ::connect(new_socket, (sockaddr *)(&address), sizeof(address));
+    int status = get_last_error();
+
+    Connection *new_connection = Network::Connection::allocate_and_init_connection(new_socket, ip_address, port);
+    new_connection->connected = false;
+
+    if(code == SOCKET_ERROR)
+    {
+        // Didn't connect immediately
+        if(status != CODE_IN_PROGRESS && status != CODE_WOULD_BLOCK)
+        {
+            // There was an actual error
+            Log::log_error("Error creating connection: %i", status);
+            Network::disconnect(&new_connection);
+            return nullptr;
+        }
+    }
+    else
+    {
+        // Connected immediately
+        new_connection->connected = true;
+        Log::log_info("Connected to server %s:%i", ip_address, port);
+    }
+
+    return new_connection;
+}
+
+void Network::disconnect(Network::Connection **connection)
+{
+    if(*connection == nullptr) return;
+
+    set_blocking_mode((*connection)->tcp_socket, BLOCKING);
+
+    if((*connection)->connected)
+    {
+        int result = ::shutdown((*connection)->tcp_socket, SHUT_WR);
+        if(result == SOCKET_ERROR)
+        {
+            Log::log_error("Could not send shutdown signal");
+        }
+
+        // TODO: Have a timeout period
+        static char buf[1024];
+        while(true)
+        {
+            int received_bytes = 0;
+            bool success = read_bytes_from_socket((*connection)->tcp_socket,
+                    buf, sizeof(buf), &received_bytes);
+            if(!success) break;
+            if(success && received_bytes == 0) break;
+        }
+
+        Log::log_info("Disconnected from %s:%i", (*connection)->ip_address, (*connection)->port);
+    }
+
+    close_socket((*connection)->tcp_socket);
+
+    //delete (*connection)->recorded_frames;
+    delete[] (*connection)->receive_buffer;
+    delete *connection;
+    *connection = nullptr;
+}
+
+bool Network::listen_for_client_connections(int port)
+{
+    // Create a listening socket
+    SOCKET listening_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(listening_socket == INVALID_SOCKET)
+    {
+        Log::log_error("Couldn't create listening socket: %d\n", get_last_error());
+        return false;
+    }
+
+    set_blocking_mode(listening_socket, NONBLOCKING);
+
+    // Allow restarting a server right away without waiting on TIME_WAIT
+    int reuse = 1;
+    setsockopt(listening_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in bound_address = {};
+    bound_address.sin_family = AF_INET;
+    bound_address.sin_addr.s_addr = INADDR_ANY;
+    bound_address.sin_port = htons(port);
+
+    int error = bind(listening_socket, (sockaddr *)(&bound_address), sizeof(bound_address));
+    if(error == SOCKET_ERROR)
+    {
+        error = get_last_error();
+        Log::log_error("Couldn't bind listening socket to port: %d, error: %d\n", port, error);
+        close_socket(listening_socket);
+        return false;
+    }
+
+    error = listen(listening_socket, SOMAXCONN);
+    if(error == SOCKET_ERROR)
+    {
+        Log::log_error("Couldn't listen on the created socket: %d\n", get_last_error());
+        close_socket(listening_socket);
+        return false;
+    }
+
+    instance->listening_socket = listening_socket;
+
+    Log::log_info("Server listening on port %i...", port);
+    return true;
+}
+
+void Network::stop_listening_for_client_connections()
+{
+    if(instance->listening_socket != INVALID_SOCKET)
+    {
+        close_socket(instance->listening_socket);
+    }
+    instance->listening_socket = INVALID_SOCKET;
+}
+
+std::vector<Network::Connection *> Network::accept_client_connections()
+{
+    std::vector<Connection *> connections;
+
+    int return_code = 0;
+    do
+    {
+        sockaddr_in client_address;
+        socklen_t client_address_size = sizeof(sockaddr_in);
+        SOCKET incoming_socket = accept(instance->listening_socket, (sockaddr *)(&client_address), &client_address_size);
+        if(incoming_socket == INVALID_SOCKET)
+        {
+            return_code = get_last_error();
+
+            // NOTE:
+            // This might fail if 2 servers are open on one port
+
+            if(return_code != CODE_WOULD_BLOCK)
+            {
+                Log::log_error("Error accepting client: %d\n", get_last_error());
+            }
+            break;
+        }
+
+        // Sockets don't inherit O_NONBLOCK from the listening socket on Linux
+        set_blocking_mode(incoming_socket, NONBLOCKING);
+
+        // Valid socket
+        char ip_address_string[NI_MAXHOST];
+        char port_string[NI_MAXSERV];
+        int rc = getnameinfo((struct sockaddr *)&client_address, client_address_size,
+                ip_address_string, sizeof(ip_address_string),
+                port_string, sizeof(port_string),
+                NI_NUMERICHOST | NI_NUMERICSERV);
+        if(rc != 0)
+        {
+            // Still a working connection, it just can't be named
+            Log::log_warning("Could not get client address: %s", gai_strerror(rc));
+            strcpy(ip_address_string, "unknown");
+            strcpy(port_string, "0");
+        }
+        int port_number = atoi(port_string);
+
+        Connection *client_connection =
+            Network::Connection::allocate_and_init_connection(incoming_socket, ip_address_string, port_number);
+
+        connections.push_back(client_connection);
+
+        time_t now;
+        time(&now);
+        Log::log_info("%s: Client connected on port %i", ctime(&now), client_connection->port);
+
+    } while(return_code != CODE_WOULD_BLOCK);
+
+    return connections;
+}
+
+void Network::Connection::send_stream(Serialization::Stream *stream)
+{
+    assert(stream->size() > 0);
+
+    // Send data over TCP
+    char *stream_data = stream->data();
+    int bytes = stream->size();
+
+    // TODO: Move this out
+    char *send_buffer = new char[HEADER_SIZE + bytes]();
+    Header header = { bytes };
+    *(Header *)send_buffer = header;
+    Platform::Memory::memcpy(send_buffer + HEADER_SIZE, stream_data, bytes);
+
+    long int bytes_queued = send(tcp_socket, send_buffer, HEADER_SIZE + bytes, MSG_NOSIGNAL);
+    if(bytes_queued == SOCKET_ERROR)
+    {
+        Log::log_error("Error sending data: %i\n", get_last_error());
+    }
+
+    if(bytes_queued != HEADER_SIZE + bytes)
+    {
+        Log::log_warning("Couldn't queue the requested number of bytes for sending. Requested: %i - Queued: %i",
+                HEADER_SIZE + bytes, bytes_queued);
+    }
+
+    delete[] send_buffer;
+}
+
+Network::ReadResult Network::Connection::read_into_stream(Serialization::Stream *stream)
+{
+    if(!connected)
+    {
+        return Network::ReadResult::CLOSED;
+    }
+
+    // Update the connection data (read into buffer) and state (closed or still open)
+    update_receive_state();
+
+    // Check if the connection was closed after the read
+    if(!connected)
+    {
+        Log::log_info("Connection to %s:%i closed", ip_address, port);
+        return Network::ReadResult::CLOSED;
+    }
+
+    // Check if game data is ready to be read
+    if(ready_to_read())
+    {
+        read_last_frame_into_stream(stream);
+        return Network::ReadResult::READY;
+    }
+    else
+    {
+        return Network::ReadResult::NOT_READY;
+    }
+}
+
+bool Network::Connection::is_connected()
+{
+    return connected;
+}
+
+bool Network::Connection::check_on_connection_status()
+{
+    if(connected) return true;
+
+    // Create address
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons((unsigned short)port);
+    int error = inet_pton(AF_INET, ip_address, &address.sin_addr.s_addr);
+    if(error != 1)
+    {
+        Log::log_error("Error creating an address: %i\n", error);
+        return false;
+    }
+
+    // Try to connect
+    int code = ::connect(tcp_socket, (sockaddr *)(&address), sizeof(address));
+    int status = get_last_error();
+
+    if(code == SOCKET_ERROR)
+    {
+        if(status != CODE_IN_PROGRESS && status != CODE_WOULD_BLOCK && status != CODE_ALREADY && status != CODE_ISCONN)
+        {
+            // There was an actual error
+            Log::log_error("Could not connect to server %s:%i, error: %i", ip_address, port, status);
+            return false;
+        }
+
+        if(status == CODE_ISCONN)
+        {
+            // Connected
+            connected = true;
+            Log::log_info("Connected to server %s:%i", ip_address, port);
+            return true;
+        }
+    }
+    else
+    {
+        // Connection finished since the last check
+        connected = true;
+        Log::log_info("Connected to server %s:%i", ip_address, port);
+        return true;
+    }
+
+    return false;
+}
+
+
+
+
+bool Network::Connection::expecting_header()
+{
+    char *content = receive_buffer + Connection::HEADER_SIZE;
+    return (receive_target < content);
+}
+
+bool Network::Connection::data_frame_complete()
+{
+    if(expecting_header()) return false;
+
+    char *buffer_end = receive_buffer + HEADER_SIZE + buffer_header->content_size;
+
+    bool result = receive_target == buffer_end;
+    return result;
+}
+
+void Network::Connection::add_data_frame(const char *frame)
+{
+    const Header *frame_header = (const Header *)frame;
+    int new_frame_bytes = HEADER_SIZE + frame_header->content_size;
+    char *new_frame = new char[new_frame_bytes];
+    Platform::Memory::memcpy(new_frame, frame, new_frame_bytes);
+    recorded_frames.push_back(new_frame);
+}
+
+void Network::Connection::reset_receive_state()
+{
+    receive_target = receive_buffer;
+}
+
+void Network::Connection::update_receive_state()
+{
+    bool received_new_data = true;
+    while(received_new_data)
+    {
+        // Recieve the data
+        int receive_up_to_bytes;
+        if(expecting_header())
+        {
+            receive_up_to_bytes = HEADER_SIZE;
+        }
+        else
+        {
+            receive_up_to_bytes = buffer_header->content_size;
+        }
+
+        char *receive_buffer_end = receive_buffer + RECEIVE_BUFFER_SIZE;
+        // Make sure the receive buffer is large enough for the bytes to read in
+        assert(receive_buffer_end - receive_target >= receive_up_to_bytes);
+
+        int received_bytes;
+        received_new_data = read_bytes_from_socket(tcp_socket,
+                receive_target, receive_up_to_bytes, &received_bytes);
+
+        if(received_new_data)
+        {
+            if(received_bytes == 0)
+            {
+                // Client closed the connection
+                connected = false;
+                return;
+            }
+            else
+            {
+                receive_target += received_bytes;
+
+                if(data_frame_complete())
+                {
+                    add_data_frame(receive_buffer);
+                    reset_receive_state();
+                }
+            }
+        }
+    }
+}
+
+bool Network::Connection::ready_to_read()
+{
+    return (recorded_frames.size() > 0);
+}
+
+void Network::Connection::read_last_frame_into_stream(Serialization::Stream *stream)
+{
+    char *frame = recorded_frames.back();
+    Header *frame_header = (Header *)frame;
+
+    int content_bytes = frame_header->content_size;
+    char *content = frame + HEADER_SIZE;
+
+    stream->write_array(content_bytes, content);
+
+    delete[] frame;
+    recorded_frames.pop_back();
+
+    // Drop all previous frames for now...
+    for(int i = 0; i < recorded_frames.size(); i++)
+    {
+        delete[] recorded_frames[i];
+    }
+    recorded_frames.clear();
+}
+
+Network::Connection *Network::Connection::allocate_and_init_connection(unsigned int in_socket, const char *ip_address, int port)
+{
+    Network::Connection *new_connection = new Network::Connection();
+
+    new_connection->receive_buffer = new char[Network::Connection::RECEIVE_BUFFER_SIZE]();
+    new_connection->receive_target = new_connection->receive_buffer;
+
+    new_connection->tcp_socket = in_socket;
+    strcpy(new_connection->ip_address, ip_address);
+    new_connection->port = port;
+    new_connection->connected = true;
+
+    return new_connection;
+}
+
+
+
+
+
@@ -0,0 +1,453 @@
+
+#include "game.h"
+#include "logging.h"
+#include "data_structures.h"
+#include "graphics.h"
+
+#include "platform.h"
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <vector>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+
+struct PlatformState
+{
+    // There is no window on Linux (yet), these are the dimensions reported to
+    // the game and ImGui
+    struct WindowState
+    {
+        int width;
+        int height;
+    } window;
+
+    struct InputState
+    {
+        static const int MAX_KEYS = 256;
+        static const int MAX_MOUSE_KEYS = 8;
+
+        bool current_key_states[MAX_KEYS];
+        bool previous_key_states[MAX_KEYS];
+        bool event_key_states[MAX_KEYS]; // For recording key press events
+
+        bool current_mouse_states[MAX_MOUSE_KEYS];
+        bool previous_mouse_states[MAX_MOUSE_KEYS];
+        bool event_mouse_states[MAX_MOUSE_KEYS]; // For recording key press events
+    } input;
+
+    bool want_to_close;
+
+    timespec start_time;
+};
+PlatformState *Platform::instance = nullptr;
+
+static const int DEFAULT_WINDOW_WIDTH = 960;
+static const int DEFAULT_WINDOW_HEIGHT = 540;
+static const int DEFAULT_MONITOR_FREQUENCY = 60;
+
+
+
+// Set from the signal handler, picked up in handle_os_events
+static volatile sig_atomic_t received_quit_signal = 0;
+
+static void handle_quit_signal(int signal_number)
+{
+    received_quit_signal = 1;
+}
+
+static double seconds_between(timespec start, timespec end)
+{
+    double seconds = (double)(end.tv_sec - start.tv_sec);
+    double nanoseconds = (double)(end.tv_nsec - start.tv_nsec);
+    return seconds + nanoseconds / 1000000000.0;
+}
+
+void Platform::init()
+{
+    instance = new PlatformState();
+    Platform::Memory::memset(instance, 0, sizeof(PlatformState));
+
+    clock_gettime(CLOCK_MONOTONIC, &instance->start_time);
+
+    instance->window.width = DEFAULT_WINDOW_WIDTH;
+    instance->window.height = DEFAULT_WINDOW_HEIGHT;
+
+    // Shut down cleanly on Ctrl+C or when a service manager stops us
+    struct sigaction action = {};
+    action.sa_handler = handle_quit_signal;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // A closed client connection shouldn't kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    int result = mkdir("output", 0755);
+    if(result == 0 || errno == EEXIST)
+    {
+    }
+    else
+    {
+        // Failed to create directory.
+    }
+
+
+    // Input
+    {
+        Platform::Memory::memset(instance->input.current_key_states,  0, sizeof(bool) * PlatformState::InputState::MAX_KEYS);
+        Platform::Memory::memset(instance->input.previous_key_states, 0, sizeof(bool) * PlatformState::InputState::MAX_KEYS);
+        Platform::Memory::memset(instance->input.event_key_states,    0, sizeof(bool) * PlatformState::InputState::MAX_KEYS);
+
+        Platform::Memory::memset(instance->input.current_mouse_states, 0,
+                sizeof(bool) * PlatformState::InputState::MAX_MOUSE_KEYS);
+        Platform::Memory::memset(instance->input.previous_mouse_states, 0,
+                sizeof(bool) * PlatformState::InputState::MAX_MOUSE_KEYS);
+        Platform::Memory::memset(instance->input.event_mouse_states, 0,
+                sizeof(bool) * PlatformState::InputState::MAX_MOUSE_KEYS);
+    }
+}
+
+void Platform::shutdown()
+{
+    // Nothing set up by init outlives the process here
+}
+
+void Platform::handle_os_events()
+{
+    if(received_quit_signal)
+    {
+        instance->want_to_close = true;
+    }
+
+    if(instance->want_to_close)
+    {
+        Engine::stop();
+    }
+}
+
+double Platform::time_since_start()
+{
+    timespec current_time;
+    clock_gettime(CLOCK_MONOTONIC, &current_time);
+
+    double dt = seconds_between(instance->start_time, current_time);
+
+    return dt;
+}
+
+void Platform::sleep(double seconds)
+{
+    if(seconds <= 0.0) return;
+
+    timespec duration;
+    duration.tv_sec = (time_t)seconds;
+    duration.tv_nsec = (long)((seconds - (double)duration.tv_sec) * 1000000000.0);
+
+    // Restart if a signal interrupts the sleep, the quit flag is checked afterwards anyways
+    while(clock_nanosleep(CLOCK_MONOTONIC, 0, &duration, &duration) == EINTR)
+    {
+        if(received_quit_signal) break;
+    }
+}
+
+bool Platform::want_to_close()
+{
+    return instance->want_to_close;
+}
+
+
+int Platform::Window::screen_width()
+{
+    return instance->window.width;
+}
+
+int Platform::Window::screen_height()
+{
+    return instance->window.height;
+}
+
+int Platform::Window::monitor_frequency()
+{
+    return DEFAULT_MONITOR_FREQUENCY;
+}
+
+float Platform::Window::aspect_ratio()
+{
+    return (float)instance->window.width / instance->window.height;
+}
+
+void Platform::Memory::memset(void *buffer, int value, int bytes)
+{
+    ::memset(buffer, value, bytes);
+}
+
+void Platform::Memory::memcpy(void *dest, const void *src, int bytes)
+{
+    ::memcpy(dest, src, bytes);
+}
+
+int Platform::Memory::memcmp(const void *a, const void *b, int bytes)
+{
+    return ::memcmp(a, b, bytes);
+}
+
+
+
+
+struct Platform::File
+{
+    FILE *file;
+};
+static bool directory_exists(const char *path)
+{
+    struct stat info;
+    if(stat(path, &info) != 0) return false;
+    return S_ISDIR(info.st_mode);
+}
+
+static void ensure_directory_exists(const char *path)
+{
+    int path_length = strlen(path);
+
+    char *path_copy = new char[path_length + 1]();
+    strcpy(path_copy, path);
+
+    std::vector<char *> dirs_stack;
+
+    char *start = path_copy;
+    char *end = start + path_length;
+
+    if(*end == '/')
+    {
+        delete[] path_copy;
+        return;
+    }
+
+    while(true)
+    {
+        while(*end != '/' && end != start)
+        {
+            end--;
+        }
+
+        // If finished with the whole spath, break;
+        if(end == start) break;
+
+        // Check if the directory exists
+        *end = '\0';
+        bool exists = directory_exists(start);
+        *end = '/'; // Replace the forward slash after marking the null terminator
+        if( exists ) break;
+
+        // Record the directory to create
+        dirs_stack.push_back(end);
+        end--;
+    }
+
+    while(!dirs_stack.empty())
+    {
+        char *dir_path_end = dirs_stack.back();
+        dirs_stack.pop_back();
+
+        *dir_path_end = '\0';
+        mkdir(start, 0755);
+        *dir_path_end = '/';
+    }
+
+    delete[] path_copy;
+}
+
+Platform::File *Platform::FileSystem::open(const char *path, FileMode mode)
+{
+    ensure_directory_exists(path);
+
+    char mode_string[8] = {};
+    switch(mode)
+    {
+        case READ:
+            strcpy(mode_string, "rb");
+            break;
+        case WRITE:
+            strcpy(mode_string, "wb");
+            break;
+        case READ_WRITE:
+            strcpy(mode_string, "r+b");
+            break;
+    }
+
+    FILE *handle = fopen(path, mode_string);
+    if(handle == NULL)
+    {
+        //Log::log_error("Couldn't open file %s", path);
+        return nullptr;
+    }
+
+    Platform::File *file = new File();
+    file->file = handle;
+    return file;
+}
+
+void Platform::FileSystem::close(Platform::File *file)
+{
+    fclose(file->file);
+    delete file;
+}
+
+void Platform::FileSystem::read(File *file, void *buffer, int bytes)
+{
+    size_t result = fread(buffer, bytes, 1, file->file);
+    (void)result;
+}
+
+void Platform::FileSystem::write(File *file, void *buffer, int bytes)
+{
+    fwrite(buffer, bytes, 1, file->file);
+}
+
+int Platform::FileSystem::size(File *file)
+{
+    fseek(file->file, 0, SEEK_END);
+    int size = ftell(file->file);
+    fseek(file->file, 0, SEEK_SET);
+    return size;
+}
+
+const char *Platform::FileSystem::map(const char *path, int *size)
+{
+    int descriptor = ::open(path, O_RDONLY);
+    if(descriptor == -1) return nullptr;
+
+    struct stat info;
+    if(fstat(descriptor, &info) != 0 || info.st_size == 0)
+    {
+        ::close(descriptor);
+        return nullptr;
+    }
+
+    // The mapping stays valid after the descriptor is closed
+    void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    ::close(descriptor);
+    if(data == MAP_FAILED) return nullptr;
+
+    *size = (int)info.st_size;
+    return (const char *)data;
+}
+
+void Platform::FileSystem::unmap(const char *data, int size)
+{
+    munmap((void *)data, size);
+}
+
+char *Platform::FileSystem::read_file_into_string(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == nullptr) return nullptr;
+
+    fseek(file, 0L, SEEK_END);
+    int size = ftell(file);
+    fseek(file, 0L, SEEK_SET);
+
+    char *buffer = new char[size + 1]();
+
+    size_t result = fread(buffer, size, 1, file);
+    (void)result;
+    fclose(file);
+
+    buffer[size] = '\0';
+
+    return buffer;
+}
+
+
+
+// For recording key press events
+void Platform::Input::record_key_event(int vk_code, bool state)
+{
+    instance->input.event_key_states[vk_code] = state;
+}
+
+// For recording key press events
+void Platform::Input::record_mouse_event(int vk_code, bool state)
+{
+    instance->input.event_mouse_states[vk_code] = state;
+}
+
+void Platform::Input::read_input()
+{
+    // Read keyboard input
+    Platform::Memory::memcpy(instance->input.previous_key_states, instance->input.current_key_states, sizeof(bool) * PlatformState::InputState::MAX_KEYS);
+    Platform::Memory::memcpy(instance->input.current_key_states, instance->input.event_key_states, sizeof(bool) * PlatformState::InputState::MAX_KEYS);
+
+    // Read mouse input
+    Platform::Memory::memcpy(instance->input.previous_mouse_states, instance->input.current_mouse_states, sizeof(bool) * PlatformState::InputState::MAX_MOUSE_KEYS);
+    Platform::Memory::memcpy(instance->input.current_mouse_states, instance->input.event_mouse_states, sizeof(bool) * PlatformState::InputState::MAX_MOUSE_KEYS);
+}
+
+
+bool Platform::Input::key_down(int key)
+{
+    assert(key < PlatformState::InputState::MAX_KEYS);
+    return (instance->input.previous_key_states[key] == false && instance->input.current_key_states[key] == true) ? true : false;
+}
+
+bool Platform::Input::key(int key)
+{
+    assert(key < PlatformState::InputState::MAX_KEYS);
+    return instance->input.current_key_states[key];
+}
+
+
+bool Platform::Input::mouse_button_down(int key)
+{
+    assert(key < PlatformState::InputState::MAX_MOUSE_KEYS);
+    return (instance->input.previous_mouse_states[key] == false && instance->input.current_mouse_states[key] == true) ? true : false;
+}
+
+bool Platform::Input::mouse_button(int key)
+{
+    assert(key < PlatformState::InputState::MAX_MOUSE_KEYS);
+    return instance->input.current_mouse_states[key];
+}
+
+GameMath::v2 Platform::Input::mouse_world_position()
+{
+#if HEADLESS
+    return GameMath::v2();
+#else
+    int sx, sy;
+    Platform::Input::mouse_screen_position(&sx, &sy);
+    GameMath::v2 p = GameMath::v2((float)sx, (float)sy);
+    float screen_width = Platform::Window::screen_width();
+    float screen_height = Platform::Window::screen_height();
+
+    p.y = screen_height - p.y;
+
+    GameMath::v2 ndc =
+    {
+        (p.x / screen_width)  * 2.0f - 1.0f,
+        (p.y / screen_height) * 2.0f - 1.0f,
+    };
+
+    GameMath::v4 ndc4 = {ndc, 0.0f, 1.0f};
+    GameMath::v4 world4 = Graphics::world_m_ndc() * ndc4;
+
+    return GameMath::v2(world4.x, world4.y);
+#endif
+}
+
+void Platform::Input::mouse_screen_position(int *x, int *y)
+{
+    // No window to point at, report the center of the screen
+    *x = instance->window.width / 2;
+    *y = instance->window.height / 2;
+}
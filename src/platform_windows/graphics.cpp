@@ -58,9 +58,11 @@ struct GraphicsState
     };
 
     void render_quad_batch(std::vector<QuadRenderingData> *packed_data);
+    void render_quad_cache(QuadCache *cache);
 
     struct LayerGroup
     {
+        std::vector<QuadCache *> quad_caches; // Drawn before the quads packed this frame
         std::vector<GraphicsState::QuadRenderingData> quads_packed_buffer;
         void pack_quad(QuadRenderingData *quad)
         {
@@ -72,6 +74,14 @@ struct GraphicsState
 GraphicsState *Graphics::instance = nullptr;
 CameraState *Graphics::Camera::instance = nullptr;
 
+struct QuadCache
+{
+    ObjectBuffer *buffer;
+    std::vector<GraphicsState::QuadRenderingData> quads;
+    int uploaded_quads;
+    bool dirty; // Quads changed since the last upload
+};
+
 static const int TARGET_GL_VERSION[2] = { 4, 4 }; // {major, minor}
 
 
@@ -212,6 +222,77 @@ static void use_texture(Texture *texture)
     glBindTexture(GL_TEXTURE_2D, texture->handle);
 }
 
+static ObjectBuffer *make_quad_object_buffer(int max_quads, GLenum usage)
+{
+    ObjectBuffer *object_buffer = new ObjectBuffer();
+    glGenVertexArrays(1, &object_buffer->vao);
+    glBindVertexArray(object_buffer->vao);
+    check_gl_errors("making vao");
+
+    glGenBuffers(1, &object_buffer->vbo);
+    check_gl_errors("making vbo");
+
+    glBindBuffer(GL_ARRAY_BUFFER, object_buffer->vbo);
+    glBufferData(GL_ARRAY_BUFFER, max_quads * sizeof(GraphicsState::QuadRenderingData), nullptr, usage);
+    check_gl_errors("send vbo data");
+    object_buffer->bytes_capacity = max_quads * sizeof(GraphicsState::QuadRenderingData);
+
+    float stride = sizeof(GraphicsState::QuadRenderingData);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void *)0); // Position
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void *)(1 * sizeof(v2))); // Scale
+    glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (void *)(2 * sizeof(v2))); // Color
+    glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride, (void *)(2 * sizeof(v2) + sizeof(v4))); // Rotation
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+    check_gl_errors("vertex attrib pointer");
+
+    return object_buffer;
+}
+
+static void free_object_buffer(ObjectBuffer *object_buffer)
+{
+    glDeleteBuffers(1, &object_buffer->vbo);
+    glDeleteVertexArrays(1, &object_buffer->vao);
+    delete object_buffer;
+}
+
+void GraphicsState::render_quad_cache(QuadCache *cache)
+{
+    if(cache->dirty)
+    {
+        // Grow to fit, otherwise the old buffer is reused
+        int bytes = sizeof(GraphicsState::QuadRenderingData) * cache->quads.size();
+        if(cache->buffer == nullptr || bytes > cache->buffer->bytes_capacity)
+        {
+            if(cache->buffer) free_object_buffer(cache->buffer);
+            cache->buffer = make_quad_object_buffer(max((int)cache->quads.size(), 1), GL_STATIC_DRAW);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, cache->buffer->vbo);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, bytes, cache->quads.data());
+        check_gl_errors("send cached quad data");
+
+        cache->uploaded_quads = cache->quads.size();
+        cache->dirty = false;
+    }
+
+    if(cache->uploaded_quads == 0) return;
+
+    Shader *shader = batch_quad_shader;
+    use_shader(shader);
+    mat4 project_m_world = Graphics::ndc_m_world();
+    set_uniform(shader, "vp", project_m_world);
+
+    glBindVertexArray(cache->buffer->vao);
+    check_gl_errors("use vao");
+
+    use_texture(white_texture);
+
+    glDrawArrays(GL_POINTS, 0, cache->uploaded_quads);
+}
+
 void GraphicsState::render_quad_batch(std::vector<GraphicsState::QuadRenderingData> *packed_data)
 {
     if(packed_data->empty()) return;
@@ -260,6 +341,39 @@ void Graphics::quad(v2 position, v2 scale, float rotation, v4 color, int layer)
     group->pack_quad(&data);
 }
 
+QuadCache *Graphics::make_quad_cache()
+{
+    QuadCache *cache = new QuadCache();
+    cache->buffer = nullptr;
+    cache->uploaded_quads = 0;
+    cache->dirty = false;
+    return cache;
+}
+
+void Graphics::free_quad_cache(QuadCache *cache)
+{
+    if(cache->buffer) free_object_buffer(cache->buffer);
+    delete cache;
+}
+
+void Graphics::clear_quad_cache(QuadCache *cache)
+{
+    cache->quads.clear();
+    cache->dirty = true;
+}
+
+void Graphics::cache_quad(QuadCache *cache, v2 position, v2 scale, float rotation, v4 color)
+{
+    cache->quads.push_back({position, scale, color, rotation});
+    cache->dirty = true;
+}
+
+void Graphics::draw_quad_cache(QuadCache *cache, int layer)
+{
+    GraphicsState::LayerGroup *group = get_or_add_layer_group(layer);
+    group->quad_caches.push_back(cache);
+}
+
 
 
 
@@ -285,30 +399,8 @@ void Graphics::init()
 
     // Make quad object buffer
     {
-        instance->batch_quad_buffer = new ObjectBuffer();
-        glGenVertexArrays(1, &instance->batch_quad_buffer->vao);
-        glBindVertexArray(instance->batch_quad_buffer->vao);
-        check_gl_errors("making vao");
-
-        glGenBuffers(1, &instance->batch_quad_buffer->vbo);
-        check_gl_errors("making vbo");
-
         static const int MAX_QUADS = 1024 * 10;
-        glBindBuffer(GL_ARRAY_BUFFER, instance->batch_quad_buffer->vbo);
-        glBufferData(GL_ARRAY_BUFFER, MAX_QUADS * sizeof(GraphicsState::QuadRenderingData), nullptr, GL_DYNAMIC_DRAW);
-        check_gl_errors("send vbo data");
-        instance->batch_quad_buffer->bytes_capacity = MAX_QUADS * sizeof(GraphicsState::QuadRenderingData);
-
-        float stride = sizeof(GraphicsState::QuadRenderingData);
-        glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, stride, (void *)0); // Position
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void *)(1 * sizeof(v2))); // Scale
-        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (void *)(2 * sizeof(v2))); // Color
-        glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride, (void *)(2 * sizeof(v2) + sizeof(v4))); // Rotation
-        glEnableVertexAttribArray(0);
-        glEnableVertexAttribArray(1);
-        glEnableVertexAttribArray(2);
-        glEnableVertexAttribArray(3);
-        check_gl_errors("vertex attrib pointer");
+        instance->batch_quad_buffer = make_quad_object_buffer(MAX_QUADS, GL_DYNAMIC_DRAW);
     }
     
     // Make texture
@@ -332,6 +424,13 @@ void Graphics::render()
     {
         GraphicsState::LayerGroup *group = pair.second;
 
+        // Render retained quads, they're only uploaded again when they change
+        for(QuadCache *cache : group->quad_caches)
+        {
+            instance->render_quad_cache(cache);
+        }
+        group->quad_caches.clear();
+
         // Render all quads
         instance->render_quad_batch(&group->quads_packed_buffer);
         group->quads_packed_buffer.clear();
@@ -390,6 +489,14 @@ float &Graphics::Camera::width()
     return instance->width;
 }
 
+void Graphics::Camera::view_bounds(v2 *bl, v2 *tr)
+{
+    // Matches ndc_m_world, the height is the width over the aspect ratio
+    v2 half_extents = v2(instance->width, instance->width / Graphics::instance->screen_aspect_ratio) * 0.5f;
+    *bl = instance->position - half_extents;
+    *tr = instance->position + half_extents;
+}
+
 
 
 
@@ -4,6 +4,6 @@
 
 int CALLBACK WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 {
-    Engine::start();
+    Engine::start(__argc, __argv);
 }
 
@@ -102,6 +102,9 @@ void Platform::init()
 
     QueryPerformanceCounter(&instance->start_time_counter);
 
+    // Ask for 1ms scheduler granularity so Platform::sleep is usable for frame pacing
+    timeBeginPeriod(1);
+
     // Create the window class
     WNDCLASS window_class = {};
 
@@ -180,6 +183,11 @@ void Platform::init()
     }
 }
 
+void Platform::shutdown()
+{
+    timeEndPeriod(1);
+}
+
 void Platform::handle_os_events()
 {
     MSG message;
@@ -215,6 +223,14 @@ double Platform::time_since_start()
     return dt;
 }
 
+void Platform::sleep(double seconds)
+{
+    if(seconds <= 0.0) return;
+
+    DWORD milliseconds = (DWORD)(seconds * 1000.0);
+    Sleep(milliseconds);
+}
+
 bool Platform::want_to_close()
 {
     return instance->want_to_close;
@@ -301,6 +317,11 @@ void Platform::Memory::memcpy(void *dest, const void *src, int bytes)
     ::memcpy(dest, src, bytes);
 }
 
+int Platform::Memory::memcmp(const void *a, const void *b, int bytes)
+{
+    return ::memcmp(a, b, bytes);
+}
+
 
 
 
@@ -420,6 +441,36 @@ int Platform::FileSystem::size(File *file)
     return size;
 }
 
+const char *Platform::FileSystem::map(const char *path, int *size)
+{
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return nullptr;
+
+    DWORD file_size = GetFileSize(file, NULL);
+    if(file_size == 0 || file_size == INVALID_FILE_SIZE)
+    {
+        CloseHandle(file);
+        return nullptr;
+    }
+
+    // The view keeps the mapping alive, both handles can go right away
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file);
+    if(mapping == NULL) return nullptr;
+
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if(data == NULL) return nullptr;
+
+    *size = (int)file_size;
+    return (const char *)data;
+}
+
+void Platform::FileSystem::unmap(const char *data, int size)
+{
+    UnmapViewOfFile(data);
+}
+
 char *Platform::FileSystem::read_file_into_string(const char *path)
 {
     FILE *file = fopen(path, "rb");